@@ -16,6 +16,45 @@
 
 #include "aesd-circular-buffer.h"
 
+#ifdef AESD_CIRCULAR_BUFFER_SPLIT_LAYOUT
+/**
+* Split layout version of aesd_circular_buffer_find_entry_offset_for_fpos(): a binary search
+* over buffer->start, which reads no entry except the one returned.
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn )
+{
+    uint8_t out = buffer->out_offs;
+    size_t base = buffer->start[out];
+    unsigned int count, lo, hi, slot;
+    
+    //check empty, or past the end
+    if(((buffer->in_offs == out) && !buffer->full) || char_offset >= buffer->head - base)
+        return NULL;
+    count = buffer->full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+            : (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - out) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    
+    //find the last entry starting at or before char_offset
+    lo = 0;
+    hi = count - 1;
+    while(lo < hi) {
+        unsigned int mid = (lo + hi + 1) / 2;
+        slot = out + mid;
+        if(slot >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+            slot -= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if(buffer->start[slot] - base <= char_offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    slot = out + lo;
+    if(slot >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        slot -= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    
+    *entry_offset_byte_rtn = char_offset - (buffer->start[slot] - base);
+    return &(buffer->entry[slot]);
+}
+#else
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -70,6 +109,7 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
     //set the return struct
     return entry;
 }
+#endif
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
@@ -83,11 +123,18 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     //set the add_entry to the in offset
     uint8_t in_temp = buffer->in_offs;
     uint8_t out_temp = buffer->out_offs;
-    buffer->entry[in_temp] = *add_entry;
     
     if(buffer->full) {
+        //the overwritten entry leaves the buffer
+        buffer->total_size -= buffer->entry[in_temp].size;
         out_temp = out_temp + 1;
     }
+    buffer->entry[in_temp] = *add_entry;
+    buffer->total_size += add_entry->size;
+#ifdef AESD_CIRCULAR_BUFFER_SPLIT_LAYOUT
+    buffer->start[in_temp] = buffer->head;
+    buffer->head += add_entry->size;
+#endif
     
     //increase the in offset
     in_temp = in_temp + 1;
@@ -108,6 +155,32 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     buffer->out_offs = out_temp;
 }
 
+/**
+* Removes the oldest entry from @param buffer and advances buffer->out_offs past it.
+* Any necessary locking must be handled by the caller
+* @return the removed entry, which stays valid until the slot is written again,
+* or NULL if the buffer is empty.  Any memory it references is still owned by the caller.
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
+    
+    //check empty
+    if((buffer->in_offs == buffer->out_offs) && !buffer->full)
+        return NULL;
+    
+    entry = &(buffer->entry[buffer->out_offs]);
+    buffer->total_size -= entry->size;
+    
+    //advance the out offset, wrapping back around
+    buffer->out_offs++;
+    if(buffer->out_offs >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        buffer->out_offs = 0;
+    buffer->full = false;
+    
+    return entry;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
 */
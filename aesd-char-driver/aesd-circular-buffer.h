@@ -16,7 +16,17 @@
 #include <stdbool.h>
 #endif
 
+//user space builds may choose their own depth, at most 255
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
+
+/**
+ * Define AESD_CIRCULAR_BUFFER_SPLIT_LAYOUT to keep the start offset of every
+ * entry in a contiguous array of its own, so a position lookup is a binary
+ * search that never touches the entries.  The API and the entry array are the
+ * same in both layouts.
+ */
 
 struct aesd_buffer_entry
 {
@@ -28,10 +38,26 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Optional owner-managed descriptor of the memory behind buffptr.
+     * Never touched by the circular buffer functions.
+     */
+    void *priv;
 };
 
 struct aesd_circular_buffer
 {
+#ifdef AESD_CIRCULAR_BUFFER_SPLIT_LAYOUT
+    /**
+     * Position of the first byte of each entry in everything ever added, indexed
+     * like entry.  Only differences are meaningful, so wrapping around is harmless.
+     */
+    size_t start[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /**
+     * Position one past the last byte of the newest entry
+     */
+    size_t head;
+#endif
     /**
      * An array of pointers to memory allocated for the most recent write operations
      */
@@ -49,6 +75,10 @@ struct aesd_circular_buffer
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Sum of the sizes of the valid entries, kept up to date by add and remove
+     */
+    size_t total_size;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -56,6 +86,8 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 /**
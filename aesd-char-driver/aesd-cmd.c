@@ -0,0 +1,267 @@
+/**
+ * @file aesd-cmd.c
+ * @brief Functions for staging and storing aesdchar write commands
+ *
+ * A command is built up over one or more writes until a '\n' is seen.
+ * Bytes are appended to a chain of order-0 pages so that a producer writing
+ * one byte at a time costs a page allocation every PAGE_SIZE bytes instead of
+ * a reallocation and copy of the whole command on every write.
+ * Committed commands keep their pages, and readers walk them as segments.
+ *
+ * @author Madeleine Monfort
+ * @date 2024-04-02
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include "aesd-cmd.h"
+#include "aesd-newline.h"
+
+static struct kmem_cache *aesd_cmd_cache;
+
+/**
+ * Creates the slab cache used for command headers.
+ * @return 0 if successful, -ENOMEM otherwise
+ */
+int aesd_cmd_cache_init(void)
+{
+    aesd_cmd_cache = KMEM_CACHE(aesd_cmd, 0);
+    if(!aesd_cmd_cache)
+        return -ENOMEM;
+    return 0;
+}
+
+/**
+ * Destroys the command header cache.  All commands must already be freed.
+ */
+void aesd_cmd_cache_destroy(void)
+{
+    kmem_cache_destroy(aesd_cmd_cache);
+}
+
+/**
+ * @return a new, empty command holding one reference, or NULL if no memory is available
+ */
+struct aesd_cmd *aesd_cmd_alloc(void)
+{
+    struct aesd_cmd *cmd = kmem_cache_zalloc(aesd_cmd_cache, GFP_KERNEL);
+    if(cmd)
+        refcount_set(&cmd->ref, 1);
+    return cmd;
+}
+
+/**
+ * Takes an extra reference on @param cmd, which keeps its pages alive after
+ * it is evicted from the ring.
+ * @return cmd
+ */
+struct aesd_cmd *aesd_cmd_get(struct aesd_cmd *cmd)
+{
+    refcount_inc(&cmd->ref);
+    return cmd;
+}
+
+static void aesd_cmd_free_pages(struct aesd_cmd *cmd)
+{
+    unsigned int i;
+    for(i = 0; i < cmd->nr_pages; i++)
+        __free_page(cmd->pages[i]);
+    kvfree(cmd->pages);
+    cmd->pages = NULL;
+    cmd->nr_pages = 0;
+    cmd->max_pages = 0;
+}
+
+static void aesd_cmd_free_zchunks(struct aesd_cmd *cmd)
+{
+    unsigned int i;
+    if(!cmd->zchunks)
+        return;
+    for(i = 0; i < cmd->nr_chunks; i++)
+        kfree(cmd->zchunks[i].data);
+    kfree(cmd->zchunks);
+    cmd->zchunks = NULL;
+    cmd->nr_chunks = 0;
+}
+
+/**
+ * Drops a reference on @param cmd, freeing it and all memory it references
+ * with the last one.  NULL is ignored.
+ */
+void aesd_cmd_put(struct aesd_cmd *cmd)
+{
+    if(!cmd || !refcount_dec_and_test(&cmd->ref))
+        return;
+    aesd_cmd_free_pages(cmd);
+    aesd_cmd_free_zchunks(cmd);
+    kmem_cache_free(aesd_cmd_cache, cmd);
+}
+
+/**
+ * Ensure @param cmd has at least @param nr_pages pages allocated.
+ * The page table is grown geometrically so it is only reallocated log(n) times,
+ * and falls back to vmalloc so huge commands never need a high-order allocation.
+ */
+static int aesd_cmd_grow(struct aesd_cmd *cmd, unsigned int nr_pages)
+{
+    if(nr_pages > cmd->max_pages) {
+        unsigned int max_pages = cmd->max_pages ? cmd->max_pages : AESD_CMD_MIN_PAGES;
+        struct page **pages;
+
+        while(max_pages < nr_pages)
+            max_pages *= 2;
+        pages = kvmalloc_array(max_pages, sizeof(*pages), GFP_KERNEL);
+        if(!pages)
+            return -ENOMEM;
+        if(cmd->pages)
+            memcpy(pages, cmd->pages, cmd->nr_pages * sizeof(*pages));
+        kvfree(cmd->pages);
+        cmd->pages = pages;
+        cmd->max_pages = max_pages;
+    }
+
+    while(cmd->nr_pages < nr_pages) {
+        //GFP_KERNEL never hands out highmem, so page_address() is always valid
+        struct page *page = alloc_page(GFP_KERNEL);
+        if(!page)
+            return -ENOMEM;
+        cmd->pages[cmd->nr_pages++] = page;
+    }
+    return 0;
+}
+
+/**
+ * Appends bytes from @param from to the end of @param cmd, up to and including
+ * the first '\n', leaving the rest of the iterator for the next command.
+ * Copies stop early once cmd holds @param limit bytes.
+ * Any necessary locking must be performed by caller.
+ * @param eol set to true if the bytes appended ended with a '\n'
+ * @return number of bytes appended, or negative if error occurred:
+ *      -ENOMEM if a page could not be allocated
+ *      -EFAULT if no bytes could be copied from user space
+ */
+ssize_t aesd_cmd_append_iter(struct aesd_cmd *cmd, struct iov_iter *from, size_t limit, bool *eol)
+{
+    size_t done = 0;
+
+    *eol = false;
+    while(iov_iter_count(from) && cmd->size < limit && !*eol) {
+        size_t pg_offs = offset_in_page(cmd->size);
+        size_t chunk = min3(iov_iter_count(from), PAGE_SIZE - pg_offs, limit - cmd->size);
+        size_t copied;
+        char *dst, *nl;
+        //pages are added one at a time, the next command may need none of them
+        int rc = aesd_cmd_grow(cmd, (cmd->size >> PAGE_SHIFT) + 1);
+        if(rc)
+            return done ? done : rc;
+
+        dst = (char *)page_address(cmd->pages[cmd->size >> PAGE_SHIFT]) + pg_offs;
+        copied = copy_from_iter(dst, chunk, from);
+        if(copied == 0)
+            return done ? done : -EFAULT;
+        //give back whatever was copied past the end of the command
+        nl = (char *)aesd_find_newline(dst, copied);
+        if(nl) {
+            iov_iter_revert(from, copied - (nl - dst + 1));
+            copied = nl - dst + 1;
+            *eol = true;
+        }
+        cmd->size += copied;
+        done += copied;
+    }
+    return done;
+}
+
+/**
+ * Appends @param count bytes from kernel buffer @param buf to the end of @param cmd
+ * Any necessary locking must be performed by caller.
+ * @return number of bytes appended, or -ENOMEM if a page could not be allocated
+ */
+ssize_t aesd_cmd_append(struct aesd_cmd *cmd, const char *buf, size_t count)
+{
+    size_t done = 0;
+    int rc = aesd_cmd_grow(cmd, DIV_ROUND_UP(cmd->size + count, PAGE_SIZE));
+    if(rc)
+        return rc;
+
+    while(done < count) {
+        size_t pg_offs = offset_in_page(cmd->size);
+        size_t chunk = min_t(size_t, count - done, PAGE_SIZE - pg_offs);
+
+        memcpy((char *)page_address(cmd->pages[cmd->size >> PAGE_SHIFT]) + pg_offs, buf + done, chunk);
+        cmd->size += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+/**
+ * Stores @param cmd as the compressed chunks @param zchunks, one per page,
+ * and releases its pages.  Called once, before the command is visible to readers.
+ */
+void aesd_cmd_set_zchunks(struct aesd_cmd *cmd, struct aesd_zchunk *zchunks)
+{
+    unsigned int nr_chunks = cmd->nr_pages;
+    aesd_cmd_free_pages(cmd);
+    cmd->zchunks = zchunks;
+    cmd->nr_chunks = nr_chunks;
+}
+
+/**
+ * Zeroes the unused tail of the last page of @param cmd, so nothing stale is
+ * exposed when the pages are mapped to user space.  Called when the command is committed.
+ */
+void aesd_cmd_seal(struct aesd_cmd *cmd)
+{
+    size_t pg_offs = offset_in_page(cmd->size);
+    if(cmd->nr_pages == 0 || pg_offs == 0)
+        return;
+    memset((char *)page_address(cmd->pages[cmd->nr_pages - 1]) + pg_offs, 0, PAGE_SIZE - pg_offs);
+}
+
+/**
+ * @return the bytes of memory used by the data of @param cmd
+ */
+size_t aesd_cmd_footprint(const struct aesd_cmd *cmd)
+{
+    size_t footprint = (size_t)cmd->nr_pages * PAGE_SIZE;
+    unsigned int i;
+    for(i = 0; cmd->zchunks && i < cmd->nr_chunks; i++)
+        footprint += cmd->zchunks[i].len;
+    return footprint;
+}
+
+/**
+ * Copies bytes of @param cmd, starting at byte @param offs, to @param to
+ * until either the command or the iterator runs out.  The copy spans as many
+ * pages as needed.  Any necessary locking must be performed by caller.
+ * @return number of bytes copied (0 if offs is at or past the end of cmd),
+ *      or -EFAULT if no bytes could be copied to user space
+ */
+ssize_t aesd_cmd_copy_to_iter(const struct aesd_cmd *cmd, size_t offs, struct iov_iter *to)
+{
+    size_t done = 0;
+    size_t count;
+    if(offs >= cmd->size)
+        return 0;
+    count = min(iov_iter_count(to), cmd->size - offs);
+
+    while(done < count) {
+        size_t pg_offs = offset_in_page(offs);
+        size_t chunk = min_t(size_t, count - done, PAGE_SIZE - pg_offs);
+        size_t copied = copy_page_to_iter(cmd->pages[offs >> PAGE_SHIFT], pg_offs, chunk, to);
+
+        offs += copied;
+        done += copied;
+        if(copied < chunk)
+            return done ? done : -EFAULT;
+    }
+    return done;
+}
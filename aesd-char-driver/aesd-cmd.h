@@ -0,0 +1,114 @@
+/*
+ * aesd-cmd.h
+ *
+ *  Created on: Apr 2, 2024
+ *      Author: Madeleine Monfort
+ *
+ *  @brief Storage for the commands written to the aesdchar driver
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESD_CMD_H_
+#define AESD_CHAR_DRIVER_AESD_CMD_H_
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/refcount.h>
+
+/**
+ * Initial number of page slots in a command's page table, doubled on each growth
+ */
+#define AESD_CMD_MIN_PAGES 4
+
+struct page;
+struct iov_iter;
+
+/**
+ * One compressed page-sized chunk of a command
+ */
+struct aesd_zchunk
+{
+    void *data;
+    unsigned int len;
+};
+
+/**
+ * Header describing a single command, allocated from its own kmem_cache.
+ * The bytes of a command live in a list of order-0 pages, both while it is
+ * being staged and after it is committed, so a command of any size never
+ * needs a high-order contiguous allocation.
+ */
+struct aesd_cmd
+{
+    /**
+     * Number of bytes written to the command
+     */
+    size_t size;
+    /**
+     * Pages holding the bytes of the command, filled in order.
+     * Byte n of the command is at offset_in_page(n) of pages[n >> PAGE_SHIFT]
+     */
+    struct page **pages;
+    /**
+     * Number of entries of pages in use
+     */
+    unsigned int nr_pages;
+    /**
+     * Number of entries allocated for pages
+     */
+    unsigned int max_pages;
+    /**
+     * Compressed chunks replacing pages once the command is committed,
+     * one per PAGE_SIZE bytes of the command, or NULL when stored uncompressed
+     */
+    struct aesd_zchunk *zchunks;
+    /**
+     * Number of entries of zchunks
+     */
+    unsigned int nr_chunks;
+    /**
+     * Bytes of memory holding the data once committed, pages or compressed chunks
+     */
+    size_t footprint;
+    /**
+     * Position of the command in the order commands were completed
+     */
+    u64 seq;
+    /**
+     * Bytes committed to the device before this command, including evicted ones.
+     * The difference between two commands' stream_offs is the distance between them.
+     */
+    u64 stream_offs;
+    /**
+     * Links the command on a per-CPU staging list before it is committed,
+     * and on the persistence queue after
+     */
+    struct list_head node;
+    /**
+     * References held on the command; the ring holds one while it is stored
+     */
+    refcount_t ref;
+};
+
+extern int aesd_cmd_cache_init(void);
+
+extern void aesd_cmd_cache_destroy(void);
+
+extern struct aesd_cmd *aesd_cmd_alloc(void);
+
+extern struct aesd_cmd *aesd_cmd_get(struct aesd_cmd *cmd);
+
+extern void aesd_cmd_put(struct aesd_cmd *cmd);
+
+extern ssize_t aesd_cmd_append_iter(struct aesd_cmd *cmd, struct iov_iter *from, size_t limit, bool *eol);
+
+extern ssize_t aesd_cmd_append(struct aesd_cmd *cmd, const char *buf, size_t count);
+
+extern void aesd_cmd_set_zchunks(struct aesd_cmd *cmd, struct aesd_zchunk *zchunks);
+
+extern void aesd_cmd_seal(struct aesd_cmd *cmd);
+
+extern size_t aesd_cmd_footprint(const struct aesd_cmd *cmd);
+
+extern ssize_t aesd_cmd_copy_to_iter(const struct aesd_cmd *cmd, size_t offs, struct iov_iter *to);
+
+#endif /* AESD_CHAR_DRIVER_AESD_CMD_H_ */
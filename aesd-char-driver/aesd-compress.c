@@ -0,0 +1,252 @@
+/**
+ * @file aesd-compress.c
+ * @brief Optional compressed storage of committed aesdchar commands
+ *
+ * When the compress module parameter names a crypto API compressor (e.g. "lz4"),
+ * every committed command of at least AESD_Z_MIN_SIZE bytes is compressed one
+ * page-sized chunk at a time and its pages are released.  Chunks are
+ * decompressed on read, so a read only pays for the chunks it touches, and the
+ * last few decompressed chunks are cached.  All sizes and offsets seen by the
+ * circular buffer remain uncompressed ones.
+ *
+ * @author Madeleine Monfort
+ * @date 2024-04-16
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/crypto.h>
+#include <linux/err.h>
+#include "aesdchar.h"
+
+static char *compress = NULL;
+module_param(compress, charp, 0444);
+MODULE_PARM_DESC(compress, "Crypto API compressor for committed commands, e.g. lz4 (default off)");
+
+/**
+ * One recently decompressed chunk
+ */
+struct aesd_zcache
+{
+    /**
+     * Sequence number of the command the chunk belongs to, U64_MAX when unused
+     */
+    u64 seq;
+    unsigned int chunk;
+    struct page *page;
+};
+
+/**
+ * Allocates the compressor and chunk cache of @param dev when compression is on
+ * @return 0 if successful, negative otherwise (nothing is left allocated)
+ */
+int aesd_z_init(struct aesd_dev *dev)
+{
+    int i;
+
+    mutex_init(&dev->lock_z);
+    if(!compress)
+        return 0;
+
+    dev->ztfm = crypto_alloc_comp(compress, 0, 0);
+    if(IS_ERR(dev->ztfm)) {
+        int err = PTR_ERR(dev->ztfm);
+        printk(KERN_WARNING "aesdchar: compressor %s not available: %d\n", compress, err);
+        dev->ztfm = NULL;
+        return err;
+    }
+    //worst case output of a page is a little more than a page
+    dev->zbuf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+    dev->zcache = kcalloc(AESD_Z_CACHE_SIZE, sizeof(*dev->zcache), GFP_KERNEL);
+    if(!dev->zbuf || !dev->zcache)
+        goto fail;
+    for(i = 0; i < AESD_Z_CACHE_SIZE; i++) {
+        dev->zcache[i].seq = U64_MAX;
+        dev->zcache[i].page = alloc_page(GFP_KERNEL);
+        if(!dev->zcache[i].page)
+            goto fail;
+    }
+    return 0;
+
+fail:
+    aesd_z_cleanup(dev);
+    return -ENOMEM;
+}
+
+void aesd_z_cleanup(struct aesd_dev *dev)
+{
+    int i;
+
+    if(dev->zcache) {
+        for(i = 0; i < AESD_Z_CACHE_SIZE; i++) {
+            if(dev->zcache[i].page)
+                __free_page(dev->zcache[i].page);
+        }
+    }
+    kfree(dev->zcache);
+    kfree(dev->zbuf);
+    if(dev->ztfm)
+        crypto_free_comp(dev->ztfm);
+    dev->zcache = NULL;
+    dev->zbuf = NULL;
+    dev->ztfm = NULL;
+}
+
+/**
+ * @return true when commands of @param dev are stored compressed
+ */
+bool aesd_z_enabled(struct aesd_dev *dev)
+{
+    return dev->ztfm != NULL;
+}
+
+/**
+ * Replaces the pages of the committed command @param cmd with compressed chunks.
+ * The command is left untouched if it is small, doesn't shrink, or memory runs out.
+ * Called by aesd_commit() before the command is visible to readers.
+ */
+void aesd_z_compress(struct aesd_dev *dev, struct aesd_cmd *cmd)
+{
+    struct aesd_zchunk *zchunks;
+    size_t zsize = 0;
+    size_t done = 0;
+    unsigned int i;
+
+    if(!dev->ztfm || cmd->size < AESD_Z_MIN_SIZE)
+        return;
+    zchunks = kcalloc(cmd->nr_pages, sizeof(*zchunks), GFP_KERNEL);
+    if(!zchunks)
+        return;
+
+    mutex_lock(&dev->lock_z);
+    for(i = 0; i < cmd->nr_pages; i++) {
+        unsigned int slen = min_t(size_t, cmd->size - done, PAGE_SIZE);
+        unsigned int dlen = 2 * PAGE_SIZE;
+
+        if(crypto_comp_compress(dev->ztfm, page_address(cmd->pages[i]), slen, dev->zbuf, &dlen))
+            break;
+        zchunks[i].data = kmemdup(dev->zbuf, dlen, GFP_KERNEL);
+        if(!zchunks[i].data)
+            break;
+        zchunks[i].len = dlen;
+        zsize += dlen;
+        done += slen;
+    }
+    mutex_unlock(&dev->lock_z);
+
+    //only keep the compressed form if every chunk made it and it saves memory
+    if(i < cmd->nr_pages || zsize >= cmd->size - cmd->size / 8) {
+        for(i = 0; i < cmd->nr_pages; i++)
+            kfree(zchunks[i].data);
+        kfree(zchunks);
+        return;
+    }
+    aesd_cmd_set_zchunks(cmd, zchunks);
+}
+
+/**
+ * Finds chunk @param chunk of the compressed command @param cmd in the cache
+ * of @param dev, decompressing it into the least recently filled slot on a miss.
+ * Caller must hold dev->lock_z.
+ * @return the page holding the chunk, or NULL if decompression failed or
+ *      didn't give back the whole chunk
+ */
+static struct page *aesd_z_chunk(struct aesd_dev *dev, struct aesd_cmd *cmd, unsigned int chunk)
+{
+    struct aesd_zcache *slot;
+    unsigned int expect = min_t(size_t, cmd->size - (size_t)chunk * PAGE_SIZE, PAGE_SIZE);
+    unsigned int dlen = PAGE_SIZE;
+    int i;
+
+    for(i = 0; i < AESD_Z_CACHE_SIZE; i++) {
+        if(dev->zcache[i].seq == cmd->seq && dev->zcache[i].chunk == chunk)
+            return dev->zcache[i].page;
+    }
+
+    slot = &dev->zcache[dev->zcache_next];
+    dev->zcache_next = (dev->zcache_next + 1) % AESD_Z_CACHE_SIZE;
+    slot->seq = U64_MAX;
+    if(crypto_comp_decompress(dev->ztfm, cmd->zchunks[chunk].data, cmd->zchunks[chunk].len,
+                page_address(slot->page), &dlen))
+        return NULL;
+    //a short chunk would serve the page's stale bytes as data
+    if(dlen != expect)
+        return NULL;
+    slot->seq = cmd->seq;
+    slot->chunk = chunk;
+    return slot->page;
+}
+
+/**
+ * Copies bytes of @param cmd, starting at uncompressed byte @param offs, to
+ * @param to until either runs out, decompressing chunks as needed.
+ * Commands that are not compressed are copied straight from their pages.
+ * Any necessary locking of the ring must be performed by caller.
+ * @return number of bytes copied, or negative if error occurred:
+ *      -EFAULT if no bytes could be copied to user space
+ *      -EIO if a chunk could not be decompressed
+ */
+ssize_t aesd_z_copy_to_iter(struct aesd_dev *dev, struct aesd_cmd *cmd, size_t offs,
+            struct iov_iter *to)
+{
+    ssize_t done = 0;
+    size_t count;
+
+    if(!cmd->zchunks)
+        return aesd_cmd_copy_to_iter(cmd, offs, to);
+    if(offs >= cmd->size)
+        return 0;
+    count = min(iov_iter_count(to), cmd->size - offs);
+
+    mutex_lock(&dev->lock_z);
+    while(done < count) {
+        size_t pg_offs = offset_in_page(offs);
+        size_t chunk = min_t(size_t, count - done, PAGE_SIZE - pg_offs);
+        struct page *page = aesd_z_chunk(dev, cmd, offs >> PAGE_SHIFT);
+        size_t copied;
+
+        if(!page) {
+            done = done ? done : -EIO;
+            break;
+        }
+        copied = copy_page_to_iter(page, pg_offs, chunk, to);
+        offs += copied;
+        done += copied;
+        if(copied < chunk) {
+            done = done ? done : -EFAULT;
+            break;
+        }
+    }
+    mutex_unlock(&dev->lock_z);
+    return done;
+}
+
+/**
+ * Copies page-sized chunk @param chunk of @param cmd into @param dst,
+ * which must hold PAGE_SIZE bytes.  Works for compressed and plain commands.
+ * @return 0 if successful, -EIO if the chunk could not be decompressed
+ */
+int aesd_z_read_chunk(struct aesd_dev *dev, struct aesd_cmd *cmd, unsigned int chunk, void *dst)
+{
+    size_t len = min_t(size_t, cmd->size - (size_t)chunk * PAGE_SIZE, PAGE_SIZE);
+    struct page *page;
+
+    if(!cmd->zchunks) {
+        memcpy(dst, page_address(cmd->pages[chunk]), len);
+        return 0;
+    }
+    mutex_lock(&dev->lock_z);
+    page = aesd_z_chunk(dev, cmd, chunk);
+    if(page)
+        memcpy(dst, page_address(page), len);
+    mutex_unlock(&dev->lock_z);
+    return page ? 0 : -EIO;
+}
@@ -0,0 +1,82 @@
+/**
+ * @file aesd-debugfs.c
+ * @brief debugfs statistics of the aesdchar driver
+ *
+ * Each device gets a directory aesdchar/aesdchar<minor> holding a "stats"
+ * file with its counters and the current occupancy of its ring.  Failing to
+ * create the files is never an error, as usual for debugfs.
+ *
+ * @author Madeleine Monfort
+ * @date 2024-04-18
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include "aesdchar.h"
+
+static struct dentry *aesd_debugfs_root;
+
+void aesd_debugfs_root_init(void)
+{
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+}
+
+void aesd_debugfs_root_cleanup(void)
+{
+    debugfs_remove_recursive(aesd_debugfs_root);
+    aesd_debugfs_root = NULL;
+}
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_circular_buffer *cbuf = dev->cbuf;
+    unsigned int entries;
+    size_t bytes, mem_used;
+
+    //lock_map rather than lock_cc, so reading the stats never waits on a writer
+    spin_lock(&dev->lock_map);
+    entries = cbuf->full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+            : (cbuf->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - cbuf->out_offs)
+                % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    bytes = cbuf->total_size;
+    mem_used = dev->mem_used;
+    spin_unlock(&dev->lock_map);
+
+    seq_printf(s, "bytes_written: %lld\n", atomic64_read(&dev->stats.bytes_written));
+    seq_printf(s, "bytes_read: %lld\n", atomic64_read(&dev->stats.bytes_read));
+    seq_printf(s, "commits: %lld\n", atomic64_read(&dev->stats.commits));
+    seq_printf(s, "evictions: %lld\n", atomic64_read(&dev->stats.evictions));
+    seq_printf(s, "lock_acquired: %lld\n", atomic64_read(&dev->stats.lock_acquired));
+    seq_printf(s, "lock_contended: %lld\n", atomic64_read(&dev->stats.lock_contended));
+    seq_printf(s, "entries: %u/%d\n", entries, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    seq_printf(s, "bytes: %zu\n", bytes);
+    seq_printf(s, "mem_used: %zu\n", mem_used);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+/**
+ * Creates the debugfs directory of @param dev, named after its minor number
+ */
+void aesd_debugfs_init(struct aesd_dev *dev)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "aesdchar%u", dev->minor);
+    dev->debugfs_dir = debugfs_create_dir(name, aesd_debugfs_root);
+    debugfs_create_file("stats", 0444, dev->debugfs_dir, dev, &aesd_stats_fops);
+}
+
+void aesd_debugfs_cleanup(struct aesd_dev *dev)
+{
+    debugfs_remove_recursive(dev->debugfs_dir);
+    dev->debugfs_dir = NULL;
+}
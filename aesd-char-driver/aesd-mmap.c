@@ -0,0 +1,245 @@
+/**
+ * @file aesd-mmap.c
+ * @brief Read-only mmap() view of the aesdchar circular buffer
+ *
+ * The layout user space sees is documented with struct aesd_mmap_header in
+ * aesd_ioctl.h.  Pages are handed out by a fault handler that looks up the
+ * entry currently stored in a slot, and a slot's window is unmapped whenever
+ * its entry is replaced so the next access faults in the new pages.
+ *
+ * The core mm installs the PTE after the fault handler returns, with the page
+ * locked.  The handler rechecks the slot's generation once it holds the page
+ * lock, and the invalidation takes the lock of every old page before
+ * unmapping, so a PTE for a replaced entry is either never installed or
+ * installed before the unmap removes it.
+ *
+ * @author Madeleine Monfort
+ * @date 2024-04-04
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h> // lock_page()
+#include <linux/gfp.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/version.h>
+#include "aesdchar.h"
+#include "aesd_ioctl.h"
+
+static unsigned int mmap_window_pages = 256;
+module_param(mmap_window_pages, uint, 0444);
+MODULE_PARM_DESC(mmap_window_pages, "Pages of each entry visible through mmap (default 256)");
+
+/**
+ * Allocates the header page shared by every mapping of @param dev
+ * @return 0 if successful, -ENOMEM otherwise
+ */
+int aesd_mmap_init(struct aesd_dev *dev)
+{
+    BUILD_BUG_ON(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED > AESD_MMAP_MAX_SLOTS);
+    BUILD_BUG_ON(sizeof(struct aesd_mmap_header) > PAGE_SIZE);
+    spin_lock_init(&dev->lock_map);
+    dev->map_hdr = (struct aesd_mmap_header *)get_zeroed_page(GFP_KERNEL);
+    if(!dev->map_hdr)
+        return -ENOMEM;
+    dev->map_hdr->magic = AESD_MMAP_MAGIC;
+    dev->map_hdr->version = AESD_MMAP_VERSION;
+    dev->map_hdr->slots = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    dev->map_hdr->window_pages = mmap_window_pages;
+    dev->map_hdr->page_size = PAGE_SIZE;
+    return 0;
+}
+
+void aesd_mmap_cleanup(struct aesd_dev *dev)
+{
+    if(dev->map_inode)
+        iput(dev->map_inode);
+    free_page((unsigned long)dev->map_hdr);
+}
+
+/**
+ * Makes every open file of @param dev share one address_space, so a single
+ * unmap_mapping_range() reaches the mappings made through any device node.
+ * The first inode opened is pinned until the last open file is released.
+ */
+void aesd_mmap_attach(struct aesd_dev *dev, struct inode *inode, struct file *filp)
+{
+    spin_lock(&dev->lock_map);
+    if(!dev->map_inode) {
+        ihold(inode);
+        dev->map_inode = inode;
+    }
+    dev->map_users++;
+    filp->f_mapping = dev->map_inode->i_mapping;
+    spin_unlock(&dev->lock_map);
+}
+
+/**
+ * Undoes aesd_mmap_attach() for a released file of @param dev, dropping the
+ * shared inode with the last one.  A mapping holds its file open, so no
+ * mapping is left by then.
+ */
+void aesd_mmap_detach(struct aesd_dev *dev)
+{
+    struct inode *inode = NULL;
+
+    spin_lock(&dev->lock_map);
+    if(--dev->map_users == 0) {
+        inode = dev->map_inode;
+        dev->map_inode = NULL;
+    }
+    spin_unlock(&dev->lock_map);
+    if(inode)
+        iput(inode);
+}
+
+/**
+ * Removes the window of @param slot, which held @param cmd, from every
+ * mapping of @param dev.  Called after the entry in the slot was replaced and
+ * before cmd is released; must not hold lock_map.
+ */
+void aesd_mmap_invalidate(struct aesd_dev *dev, uint8_t slot, struct aesd_cmd *cmd)
+{
+    loff_t start = (loff_t)(1 + (loff_t)slot * mmap_window_pages) << PAGE_SHIFT;
+    loff_t len = (loff_t)mmap_window_pages << PAGE_SHIFT;
+    unsigned int nr_pages = min(cmd->nr_pages, mmap_window_pages);
+    struct inode *inode;
+    unsigned int i;
+
+    //commits from the drain work can run with no file open, keep the inode alive
+    spin_lock(&dev->lock_map);
+    inode = dev->map_inode;
+    if(inode)
+        ihold(inode);
+    spin_unlock(&dev->lock_map);
+    if(!inode)
+        return;
+
+    if(mapping_mapped(inode->i_mapping)) {
+        //wait for faults that passed the generation check to install their PTE
+        for(i = 0; i < nr_pages; i++) {
+            lock_page(cmd->pages[i]);
+            unlock_page(cmd->pages[i]);
+        }
+        unmap_mapping_range(inode->i_mapping, start, len, 1);
+    }
+    iput(inode);
+}
+
+/**
+ * Copies the current state of the circular buffer into the header page.
+ * Any necessary locking must be performed by caller.
+ */
+void aesd_mmap_publish(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *hdr = dev->map_hdr;
+    struct aesd_circular_buffer *cbuf = dev->cbuf;
+    uint8_t index;
+    struct aesd_buffer_entry *entry;
+    uint32_t count = cbuf->in_offs - cbuf->out_offs;
+
+    if(cbuf->full)
+        count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    else if(cbuf->in_offs < cbuf->out_offs)
+        count += AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+    //odd sequence tells readers an update is in progress
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+    smp_wmb();
+    hdr->out_offs = cbuf->out_offs;
+    hdr->in_offs = cbuf->in_offs;
+    hdr->count = count;
+    AESD_CIRCULAR_BUFFER_FOREACH(entry,cbuf,index) {
+        hdr->slot_size[index] = entry->priv ? entry->size : 0;
+    }
+    smp_wmb();
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+}
+
+static vm_fault_t aesd_vm_fault(struct vm_fault *vmf)
+{
+    struct aesd_dev *dev = vmf->vma->vm_private_data;
+    struct page *page = NULL;
+    unsigned long slot, pg;
+    struct aesd_cmd *cmd;
+    unsigned int gen;
+    bool stale;
+
+    if(vmf->pgoff == 0) {
+        page = virt_to_page(dev->map_hdr);
+        get_page(page);
+        vmf->page = page;
+        return 0;
+    }
+
+    slot = (vmf->pgoff - 1) / mmap_window_pages;
+    pg = (vmf->pgoff - 1) % mmap_window_pages;
+    if(slot >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        return VM_FAULT_SIGBUS;
+
+    //lock_map rather than lock_cc: a write() from this mapping faults while lock_cc is held
+    spin_lock(&dev->lock_map);
+    cmd = dev->cbuf->entry[slot].priv;
+    gen = dev->map_gen[slot];
+    if(cmd && pg < cmd->nr_pages) {
+        page = cmd->pages[pg];
+        get_page(page);
+    }
+    spin_unlock(&dev->lock_map);
+
+    if(!page)
+        return VM_FAULT_SIGBUS;
+
+    //the page stays locked until the PTE is in, see aesd_mmap_invalidate()
+    lock_page(page);
+    spin_lock(&dev->lock_map);
+    stale = dev->map_gen[slot] != gen;
+    spin_unlock(&dev->lock_map);
+    if(stale) {
+        //the entry was replaced meanwhile, fault again on the new one
+        unlock_page(page);
+        put_page(page);
+        return VM_FAULT_NOPAGE;
+    }
+    vmf->page = page;
+    return VM_FAULT_LOCKED;
+}
+
+static const struct vm_operations_struct aesd_vm_ops = {
+    .fault = aesd_vm_fault,
+};
+
+/**
+ * Sets up a read-only mapping of the header and slot windows described in aesd_ioctl.h
+ * @return 0 if successful, -EPERM if write access was requested,
+ *      -EINVAL if the mapping extends past the last slot window,
+ *      -ENODEV if entries are stored compressed and have no pages to map
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = aesd_file_dev(filp);
+    unsigned long max_pages = 1 + (unsigned long)AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * mmap_window_pages;
+
+    if(aesd_z_enabled(dev))
+        return -ENODEV;
+    if(vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    if(vma->vm_pgoff + vma_pages(vma) > max_pages)
+        return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    vma->vm_ops = &aesd_vm_ops;
+    vma->vm_private_data = dev;
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * aesd-newline.h
+ *
+ *  Created on: Apr 26, 2024
+ *      Author: Madeleine Monfort
+ *
+ *  @brief Newline search used to frame commands, shared by the driver and aesdsocket
+ *
+ *  The kernel uses memchr(), which is already optimized per architecture and
+ *  keeps the FPU out of the driver.  User space on x86 scans 32 bytes at a
+ *  time with AVX2 when the CPU has it and 16 at a time with SSE2 otherwise;
+ *  other architectures fall back to memchr().
+ */
+
+#ifndef AESD_NEWLINE_H
+#define AESD_NEWLINE_H
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#include <string.h>
+#endif
+
+#if !defined(__KERNEL__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+
+static inline const char *aesd_find_newline_sse2(const char *buf, size_t len)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if(mask)
+            return buf + i + __builtin_ctz(mask);
+    }
+    for(; i < len; i++) {
+        if(buf[i] == '\n')
+            return buf + i;
+    }
+    return NULL;
+}
+
+__attribute__((target("avx2")))
+static inline const char *aesd_find_newline_avx2(const char *buf, size_t len)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if(mask)
+            return buf + i + __builtin_ctz(mask);
+    }
+    return aesd_find_newline_sse2(buf + i, len - i);
+}
+
+/**
+ * @return a pointer to the first '\n' in the @param len bytes at @param buf, or NULL if there is none
+ */
+static inline const char *aesd_find_newline(const char *buf, size_t len)
+{
+    //short lines aren't worth the dispatch
+    if(len >= 64 && __builtin_cpu_supports("avx2"))
+        return aesd_find_newline_avx2(buf, len);
+    return aesd_find_newline_sse2(buf, len);
+}
+
+#else
+
+/**
+ * @return a pointer to the first '\n' in the @param len bytes at @param buf, or NULL if there is none
+ */
+static inline const char *aesd_find_newline(const char *buf, size_t len)
+{
+    return memchr(buf, '\n', len);
+}
+
+#endif
+
+#endif /* AESD_NEWLINE_H */
@@ -0,0 +1,230 @@
+/**
+ * @file aesd-pcpu.c
+ * @brief Optional per-CPU write combining for the aesdchar driver
+ *
+ * With the percpu_batch module parameter set, a write made of whole commands
+ * never takes lock_cc.  Each command is given a global sequence number and
+ * parked on a list owned by the writing CPU.  A drain step, run when a CPU
+ * has percpu_batch commands parked, when a reader arrives, or shortly after
+ * the last write, merges the lists and commits the commands to the circular
+ * buffer in sequence order.
+ *
+ * @author Madeleine Monfort
+ * @date 2024-04-09
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/uio.h>
+#include "aesdchar.h"
+
+static unsigned int percpu_batch = 0;
+module_param(percpu_batch, uint, 0444);
+MODULE_PARM_DESC(percpu_batch, "Stage commands per CPU and drain every N commands, 0 disables (default 0)");
+
+/**
+ * Commands staged by one CPU, oldest first
+ */
+struct aesd_pcpu
+{
+    spinlock_t lock;
+    struct list_head cmds;
+    unsigned int count;
+};
+
+static void aesd_pcpu_drain_work(struct work_struct *work)
+{
+    struct aesd_dev *dev = container_of(to_delayed_work(work), struct aesd_dev, drain_work);
+
+    aesd_lock_cc(dev);
+    aesd_pcpu_drain(dev);
+    mutex_unlock(dev->lock_cc);
+}
+
+/**
+ * Sets up the per-CPU staging lists of @param dev when percpu_batch is set.
+ * @return 0 if successful, -ENOMEM otherwise
+ */
+int aesd_pcpu_init(struct aesd_dev *dev)
+{
+    int cpu;
+
+    INIT_LIST_HEAD(&dev->pending);
+    atomic64_set(&dev->next_seq, 0);
+    dev->commit_seq = 0;
+    INIT_DELAYED_WORK(&dev->drain_work, aesd_pcpu_drain_work);
+    if(percpu_batch == 0)
+        return 0;
+
+    dev->pcpu = alloc_percpu(struct aesd_pcpu);
+    if(!dev->pcpu)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        struct aesd_pcpu *pc = per_cpu_ptr(dev->pcpu, cpu);
+        spin_lock_init(&pc->lock);
+        INIT_LIST_HEAD(&pc->cmds);
+        pc->count = 0;
+    }
+    return 0;
+}
+
+/**
+ * Commits everything still staged on @param dev and frees the per-CPU lists.
+ * No writer may be running.
+ */
+void aesd_pcpu_cleanup(struct aesd_dev *dev)
+{
+    struct aesd_cmd *cmd, *tmp;
+
+    if(!dev->pcpu)
+        return;
+    cancel_delayed_work_sync(&dev->drain_work);
+    mutex_lock(dev->lock_cc);
+    aesd_pcpu_drain(dev);
+    //with no writers left there are no gaps, but never leak a stray command
+    list_for_each_entry_safe(cmd, tmp, &dev->pending, node) {
+        list_del(&cmd->node);
+        aesd_cmd_put(cmd);
+    }
+    mutex_unlock(dev->lock_cc);
+    free_percpu(dev->pcpu);
+    dev->pcpu = NULL;
+}
+
+/**
+ * Parks the completed command @param cmd on the current CPU's list with the
+ * next sequence number.  The sequence number is taken under the per-CPU lock,
+ * so every number handed out is on a list before that lock is dropped.
+ * @return true if this CPU reached percpu_batch staged commands
+ */
+static bool aesd_pcpu_stage(struct aesd_dev *dev, struct aesd_cmd *cmd)
+{
+    struct aesd_pcpu *pc = get_cpu_ptr(dev->pcpu);
+    unsigned int count;
+
+    spin_lock(&pc->lock);
+    cmd->seq = atomic64_inc_return(&dev->next_seq) - 1;
+    list_add_tail(&cmd->node, &pc->cmds);
+    count = ++pc->count;
+    spin_unlock(&pc->lock);
+    put_cpu_ptr(dev->pcpu);
+
+    //make sure a lone writer's commands become visible even with no reader
+    schedule_delayed_work(&dev->drain_work, msecs_to_jiffies(AESD_PCPU_DRAIN_MS));
+    return count >= percpu_batch;
+}
+
+/**
+ * Stages the completed command @param cmd and commits it in order.
+ * Caller must hold dev->lock_cc, as for aesd_commit().
+ */
+void aesd_pcpu_commit(struct aesd_dev *dev, struct aesd_cmd *cmd)
+{
+    aesd_pcpu_stage(dev, cmd);
+    aesd_pcpu_drain(dev);
+}
+
+/**
+ * Fast path of aesd_write_iter() for the whole commands at the start of @param from.
+ * The bytes are copied without any lock and staged on the current CPU,
+ * one command per '\n'.  A trailing partial command is left in the iterator
+ * for the locked path.
+ * @return number of bytes staged, or negative if an error occurred before any were
+ */
+ssize_t aesd_pcpu_write(struct aesd_dev *dev, struct iov_iter *from)
+{
+    size_t limit = aesd_max_cmd_size();
+    ssize_t done = 0;
+    bool drain = false;
+
+    while(iov_iter_count(from)) {
+        struct aesd_cmd *cmd = aesd_cmd_alloc();
+        ssize_t retval;
+        bool eol;
+
+        if(!cmd) {
+            if(!done)
+                return -ENOMEM;
+            break;
+        }
+        retval = aesd_cmd_append_iter(cmd, from, limit, &eol);
+        if(retval < 0 || !eol) {
+            if(retval > 0)
+                iov_iter_revert(from, retval);
+            aesd_cmd_put(cmd);
+            if(retval < 0 && !done)
+                return retval;
+            break;
+        }
+        atomic64_add(retval, &dev->stats.bytes_written);
+        done += retval;
+        if(aesd_pcpu_stage(dev, cmd))
+            drain = true;
+    }
+
+    if(drain && mutex_trylock(dev->lock_cc)) {
+        aesd_pcpu_drain(dev);
+        mutex_unlock(dev->lock_cc);
+    }
+    return done;
+}
+
+/**
+ * Inserts @param cmd into the list @param pending, which is sorted by sequence number.
+ * New commands almost always belong at the tail, so the walk starts there.
+ */
+static void aesd_pcpu_insert(struct list_head *pending, struct aesd_cmd *cmd)
+{
+    struct aesd_cmd *pos;
+
+    list_for_each_entry_reverse(pos, pending, node) {
+        if(pos->seq < cmd->seq) {
+            list_add(&cmd->node, &pos->node);
+            return;
+        }
+    }
+    list_add(&cmd->node, pending);
+}
+
+/**
+ * Moves every staged command of @param dev into the circular buffer in
+ * sequence order.  A command whose predecessor has a sequence number but isn't
+ * on a list yet waits in dev->pending for the next drain.
+ * Caller must hold dev->lock_cc.  Does nothing when per-CPU mode is off.
+ */
+void aesd_pcpu_drain(struct aesd_dev *dev)
+{
+    struct aesd_cmd *cmd, *tmp;
+    LIST_HEAD(staged);
+    int cpu;
+
+    if(!dev->pcpu)
+        return;
+
+    for_each_possible_cpu(cpu) {
+        struct aesd_pcpu *pc = per_cpu_ptr(dev->pcpu, cpu);
+
+        spin_lock(&pc->lock);
+        list_splice_tail_init(&pc->cmds, &staged);
+        pc->count = 0;
+        spin_unlock(&pc->lock);
+    }
+    list_for_each_entry_safe(cmd, tmp, &staged, node) {
+        list_del(&cmd->node);
+        aesd_pcpu_insert(&dev->pending, cmd);
+    }
+
+    list_for_each_entry_safe(cmd, tmp, &dev->pending, node) {
+        if(cmd->seq != dev->commit_seq)
+            break;
+        list_del(&cmd->node);
+        aesd_commit(dev, cmd);
+    }
+}
@@ -0,0 +1,405 @@
+/**
+ * @file aesd-persist.c
+ * @brief Optional write-behind persistence of the aesdchar history
+ *
+ * When the persist_dir module parameter is set, every committed command is
+ * queued and appended by a delayed work item to a segment file in that
+ * directory, persist_interval_ms after the first unwritten commit.  The write
+ * path does no file I/O unless the queue outgrows the max_bytes budget.
+ *
+ * Queued commands stay pinned after the ring evicts them, so with max_bytes
+ * set their footprint is counted: past half the budget the work runs at once,
+ * and past the whole budget the writer flushes the queue itself.
+ *
+ * Each device alternates between two segments, aesdchar<minor>.0.seg and
+ * aesdchar<minor>.1.seg.  When the active one grows past persist_segment_kb,
+ * the other is truncated, seeded with the current ring contents and becomes
+ * active, so the active segment always holds the whole ring.  On load, both
+ * segments are read and the newest commands rebuild the ring.
+ *
+ * @author Madeleine Monfort
+ * @date 2024-04-11
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/crc32.h>
+#include <linux/err.h>
+#include "aesdchar.h"
+
+static char *persist_dir = NULL;
+module_param(persist_dir, charp, 0444);
+MODULE_PARM_DESC(persist_dir, "Directory for the history segment files, unset disables persistence");
+
+static unsigned int persist_interval_ms = 1000;
+module_param(persist_interval_ms, uint, 0644);
+MODULE_PARM_DESC(persist_interval_ms, "Delay before committed commands are written and synced (default 1000)");
+
+static unsigned int persist_segment_kb = 1024;
+module_param(persist_segment_kb, uint, 0644);
+MODULE_PARM_DESC(persist_segment_kb, "Size at which the other segment file takes over (default 1024)");
+
+#define AESD_PERSIST_MAGIC 0x52647361 // "asdR"
+/**
+ * Largest command accepted when reading a segment, anything bigger is treated as corruption
+ */
+#define AESD_PERSIST_MAX_CMD (64 << 20)
+
+/**
+ * Header in front of every command in a segment file, little endian
+ */
+struct aesd_persist_rec
+{
+    __le32 magic;
+    /**
+     * crc32 of the command bytes
+     */
+    __le32 crc;
+    __le64 seq;
+    __le64 size;
+};
+
+/**
+ * Appends one record for @param cmd at the end of the active segment of @param dev,
+ * using @param bounce (PAGE_SIZE bytes) to hold one uncompressed chunk at a time
+ * @return 0 if successful, negative if the write failed
+ */
+static int aesd_persist_write_cmd(struct aesd_dev *dev, struct aesd_cmd *cmd, char *bounce)
+{
+    struct file *file = dev->persist_file[dev->persist_active];
+    struct aesd_persist_rec rec;
+    u32 crc = 0;
+    size_t done;
+    unsigned int i;
+    ssize_t rc;
+
+    //committed chunks never change, so the ring lock is not needed to read them
+    for(i = 0, done = 0; done < cmd->size; i++) {
+        size_t chunk = min_t(size_t, cmd->size - done, PAGE_SIZE);
+        if(aesd_z_read_chunk(dev, cmd, i, bounce))
+            return -EIO;
+        crc = crc32_le(crc, bounce, chunk);
+        done += chunk;
+    }
+    rec.magic = cpu_to_le32(AESD_PERSIST_MAGIC);
+    rec.crc = cpu_to_le32(crc);
+    rec.seq = cpu_to_le64(cmd->seq);
+    rec.size = cpu_to_le64(cmd->size);
+
+    rc = kernel_write(file, &rec, sizeof(rec), &dev->persist_pos);
+    if(rc != sizeof(rec))
+        return rc < 0 ? rc : -EIO;
+    for(i = 0, done = 0; done < cmd->size; i++) {
+        size_t chunk = min_t(size_t, cmd->size - done, PAGE_SIZE);
+        if(aesd_z_read_chunk(dev, cmd, i, bounce))
+            return -EIO;
+        rc = kernel_write(file, bounce, chunk, &dev->persist_pos);
+        if(rc != chunk)
+            return rc < 0 ? rc : -EIO;
+        done += chunk;
+    }
+    return 0;
+}
+
+/**
+ * Makes the other segment of @param dev active, seeded with the commands
+ * currently in the ring.
+ */
+static int aesd_persist_rotate(struct aesd_dev *dev, char *bounce)
+{
+    struct aesd_cmd *snap[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_circular_buffer *cbuf = dev->cbuf;
+    int count = 0;
+    int next = !dev->persist_active;
+    int i, rc = 0;
+
+    rc = vfs_truncate(&dev->persist_file[next]->f_path, 0);
+    if(rc)
+        return rc;
+
+    aesd_lock_cc(dev);
+    if((cbuf->in_offs != cbuf->out_offs) || cbuf->full) {
+        uint8_t slot = cbuf->out_offs;
+        do {
+            snap[count++] = aesd_cmd_get(cbuf->entry[slot].priv);
+            slot = (slot + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        } while(slot != cbuf->in_offs);
+    }
+    mutex_unlock(dev->lock_cc);
+
+    dev->persist_active = next;
+    dev->persist_pos = 0;
+    for(i = 0; i < count; i++) {
+        if(!rc)
+            rc = aesd_persist_write_cmd(dev, snap[i], bounce);
+        aesd_cmd_put(snap[i]);
+    }
+    return rc;
+}
+
+/**
+ * Writes every queued command of @param dev and syncs the active segment
+ * @return 0 if successful, negative if error occurred
+ */
+static int aesd_persist_flush(struct aesd_dev *dev)
+{
+    struct aesd_cmd *cmd, *tmp;
+    LIST_HEAD(queue);
+    size_t written = 0;
+    char *bounce;
+    int rc = 0;
+
+    spin_lock(&dev->persist_lock);
+    list_splice_init(&dev->persist_queue, &queue);
+    spin_unlock(&dev->persist_lock);
+    if(list_empty(&queue))
+        return 0;
+
+    bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if(!bounce)
+        rc = -ENOMEM;
+    list_for_each_entry_safe(cmd, tmp, &queue, node) {
+        list_del(&cmd->node);
+        if(!rc)
+            rc = aesd_persist_write_cmd(dev, cmd, bounce);
+        written += cmd->footprint;
+        aesd_cmd_put(cmd);
+    }
+    spin_lock(&dev->persist_lock);
+    dev->persist_queued -= written;
+    spin_unlock(&dev->persist_lock);
+    if(!rc && dev->persist_pos > (loff_t)persist_segment_kb * 1024)
+        rc = aesd_persist_rotate(dev, bounce);
+    kfree(bounce);
+    if(!rc)
+        rc = vfs_fsync(dev->persist_file[dev->persist_active], 1);
+    if(rc)
+        printk(KERN_WARNING "aesdchar: failed to persist history: %d\n", rc);
+    return rc;
+}
+
+static void aesd_persist_work(struct work_struct *work)
+{
+    struct aesd_dev *dev = container_of(to_delayed_work(work), struct aesd_dev, persist_work);
+
+    mutex_lock(&dev->persist_io);
+    aesd_persist_flush(dev);
+    mutex_unlock(&dev->persist_io);
+}
+
+/**
+ * Writes and syncs what is queued for @param dev right away, for fsync()
+ * @return 0 if successful or persistence is off, negative if error occurred
+ */
+int aesd_persist_sync(struct aesd_dev *dev)
+{
+    int rc;
+
+    if(!dev->persist_on)
+        return 0;
+    mutex_lock(&dev->persist_io);
+    rc = aesd_persist_flush(dev);
+    mutex_unlock(&dev->persist_io);
+    return rc;
+}
+
+/**
+ * Flushes the queue of @param dev from the writer once it holds more than the
+ * max_bytes budget, so a burst can't pin evicted commands without bound.
+ * Called from aesd_write_iter() without lock_cc.
+ */
+void aesd_persist_throttle(struct aesd_dev *dev)
+{
+    size_t queued;
+
+    if(!dev->persist_on)
+        return;
+    spin_lock(&dev->persist_lock);
+    queued = dev->persist_queued;
+    spin_unlock(&dev->persist_lock);
+    if(queued >= aesd_max_cmd_size())
+        aesd_persist_sync(dev);
+}
+
+/**
+ * Queues the committed command @param cmd of @param dev to be written.
+ * Called from aesd_commit(); only takes a reference and a spinlock.
+ */
+void aesd_persist_queue(struct aesd_dev *dev, struct aesd_cmd *cmd)
+{
+    bool kick;
+
+    if(!dev->persist_on)
+        return;
+    spin_lock(&dev->persist_lock);
+    list_add_tail(&aesd_cmd_get(cmd)->node, &dev->persist_queue);
+    dev->persist_queued += cmd->footprint;
+    kick = dev->persist_queued >= aesd_max_cmd_size() / 2;
+    spin_unlock(&dev->persist_lock);
+    if(kick)
+        mod_delayed_work(system_wq, &dev->persist_work, 0);
+    else
+        schedule_delayed_work(&dev->persist_work, msecs_to_jiffies(persist_interval_ms));
+}
+
+/**
+ * Keeps @param cmd in @param keep, the @param count newest commands read so far
+ * sorted by sequence number, when it is newer than the oldest of them.
+ * @return true if cmd was kept, false if the caller still owns it
+ */
+static bool aesd_persist_keep(struct aesd_cmd **keep, int *count, struct aesd_cmd *cmd)
+{
+    int i, j;
+
+    for(i = 0; i < *count; i++) {
+        if(keep[i]->seq == cmd->seq)
+            return false; //same command in both segments
+    }
+    if(*count == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        if(cmd->seq < keep[0]->seq)
+            return false;
+        aesd_cmd_put(keep[0]);
+        memmove(&keep[0], &keep[1], (*count - 1) * sizeof(*keep));
+        (*count)--;
+    }
+    for(i = *count; i > 0 && keep[i - 1]->seq > cmd->seq; i--)
+        ;
+    for(j = *count; j > i; j--)
+        keep[j] = keep[j - 1];
+    keep[i] = cmd;
+    (*count)++;
+    return true;
+}
+
+/**
+ * Reads the valid records of segment @param file into @param keep.
+ * Reading stops at the first torn or corrupt record.
+ * @return the offset just past the last valid record
+ */
+static loff_t aesd_persist_load(struct file *file, struct aesd_cmd **keep, int *count, u64 *max_seq)
+{
+    struct aesd_persist_rec rec;
+    loff_t pos = 0;
+    loff_t valid = 0;
+    char *buf = NULL;
+
+    while(kernel_read(file, &rec, sizeof(rec), &pos) == sizeof(rec)) {
+        u64 size = le64_to_cpu(rec.size);
+        struct aesd_cmd *cmd;
+
+        if(le32_to_cpu(rec.magic) != AESD_PERSIST_MAGIC || size == 0 || size > AESD_PERSIST_MAX_CMD)
+            break;
+        buf = kvmalloc(size, GFP_KERNEL);
+        if(!buf)
+            break;
+        if(kernel_read(file, buf, size, &pos) != size || crc32_le(0, buf, size) != le32_to_cpu(rec.crc))
+            break;
+
+        cmd = aesd_cmd_alloc();
+        if(!cmd)
+            break;
+        if(aesd_cmd_append(cmd, buf, size) != size) {
+            aesd_cmd_put(cmd);
+            break;
+        }
+        cmd->seq = le64_to_cpu(rec.seq);
+        if(cmd->seq >= *max_seq)
+            *max_seq = cmd->seq + 1;
+        if(!aesd_persist_keep(keep, count, cmd))
+            aesd_cmd_put(cmd);
+        kvfree(buf);
+        buf = NULL;
+        valid = pos;
+    }
+    kvfree(buf);
+    return valid;
+}
+
+/**
+ * Opens the segment files of device number @param index and rebuilds the ring
+ * of @param dev from them.  Called before the device is added, so nothing
+ * else can touch dev yet.
+ * @return 0 if successful or persistence is off, negative if a segment could not be opened
+ */
+int aesd_persist_init(struct aesd_dev *dev, int index)
+{
+    struct aesd_cmd *keep[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    loff_t end[2];
+    u64 max_seq[2] = { 0, 0 };
+    int count = 0;
+    int i;
+
+    INIT_LIST_HEAD(&dev->persist_queue);
+    spin_lock_init(&dev->persist_lock);
+    mutex_init(&dev->persist_io);
+    INIT_DELAYED_WORK(&dev->persist_work, aesd_persist_work);
+    if(!persist_dir)
+        return 0;
+
+    for(i = 0; i < 2; i++) {
+        char *path = kasprintf(GFP_KERNEL, "%s/aesdchar%d.%d.seg", persist_dir, index, i);
+        struct file *file;
+
+        if(!path)
+            goto fail;
+        file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+        kfree(path);
+        if(IS_ERR(file)) {
+            printk(KERN_WARNING "aesdchar: can't open segment %d in %s: %ld\n", i, persist_dir, PTR_ERR(file));
+            goto fail;
+        }
+        dev->persist_file[i] = file;
+        end[i] = aesd_persist_load(file, keep, &count, &max_seq[i]);
+    }
+
+    //the segment with the newest command is the one to keep appending to
+    dev->persist_active = max_seq[1] > max_seq[0];
+    dev->persist_pos = end[dev->persist_active];
+
+    mutex_lock(dev->lock_cc);
+    for(i = 0; i < count; i++)
+        aesd_commit(dev, keep[i]);
+    atomic64_set(&dev->next_seq, max(max_seq[0], max_seq[1]));
+    dev->commit_seq = max(max_seq[0], max_seq[1]);
+    mutex_unlock(dev->lock_cc);
+    //only commands committed from here on are new to the segments
+    dev->persist_on = true;
+    return 0;
+
+fail:
+    for(i = 0; i < count; i++)
+        aesd_cmd_put(keep[i]);
+    aesd_persist_cleanup(dev);
+    return -EIO;
+}
+
+/**
+ * Writes whatever is still queued for @param dev and closes its segments
+ */
+void aesd_persist_cleanup(struct aesd_dev *dev)
+{
+    int i;
+
+    if(!dev->persist_file[0])
+        return;
+    dev->persist_on = false;
+    cancel_delayed_work_sync(&dev->persist_work);
+    mutex_lock(&dev->persist_io);
+    if(dev->persist_file[1])
+        aesd_persist_flush(dev);
+    mutex_unlock(&dev->persist_io);
+    for(i = 0; i < 2; i++) {
+        if(dev->persist_file[i])
+            filp_close(dev->persist_file[i], NULL);
+        dev->persist_file[i] = NULL;
+    }
+}
@@ -0,0 +1,110 @@
+/**
+ * @file aesd-splice.c
+ * @brief splice() support for the aesdchar driver
+ *
+ * splice_read hands the pipe references to the pages of the committed
+ * commands instead of copying them, so splice(devfd -> pipe -> socket) never
+ * touches the data in the kernel either.  Committed pages are never written
+ * again, and the pipe's reference keeps them alive after the command is
+ * evicted.  Compressed commands have no pages to share and are copied.
+ * splice_write goes through write_iter.
+ *
+ * @author Madeleine Monfort
+ * @date 2024-04-22
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/workqueue.h>
+#include <linux/version.h>
+#include "aesdchar.h"
+
+/**
+ * Pipe buffers holding pages of committed commands; the pages are shared
+ * with the ring, so a reader of the pipe may never steal them.
+ */
+static const struct pipe_buf_operations aesd_pipe_buf_ops = {
+    .release = generic_pipe_buf_release,
+    .get = generic_pipe_buf_get,
+};
+
+static void aesd_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+    put_page(spd->pages[i]);
+}
+
+/**
+ * Moves up to @param len bytes from position @param ppos of @param in into
+ * @param pipe by reference, at most PIPE_DEF_BUFFERS pages per call.
+ * Never waits for new commands, even on a following file.
+ * @return number of bytes moved, 0 at the end of the data, or negative on error
+ */
+ssize_t aesd_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+            size_t len, unsigned int flags)
+{
+    struct aesd_dev *dev = aesd_file_dev(in);
+    struct aesd_circular_buffer *cbuf = dev->cbuf;
+    struct page *pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages = pages,
+        .partial = partial,
+        .nr_pages_max = PIPE_DEF_BUFFERS,
+        .ops = &aesd_pipe_buf_ops,
+        .spd_release = aesd_spd_release,
+    };
+    struct aesd_buffer_entry *entry;
+    size_t entry_pos = 0;
+    loff_t base;
+    loff_t pos;
+    ssize_t retval;
+
+    if(aesd_z_enabled(dev)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+        return copy_splice_read(in, ppos, pipe, len, flags);
+#else
+        return generic_file_splice_read(in, ppos, pipe, len, flags);
+#endif
+    }
+
+    aesd_lock_reader(dev);
+    base = aesd_pos_base(dev, aesd_file_follow(in));
+    pos = aesd_ring_pos(*ppos, base);
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(cbuf, pos, &entry_pos);
+    //one pipe buffer per page, continuing into the following commands
+    while(entry && len && spd.nr_pages < spd.nr_pages_max) {
+        struct aesd_cmd *cmd = entry->priv;
+        size_t pg_offs = offset_in_page(entry_pos);
+        size_t chunk = min3(len, PAGE_SIZE - pg_offs, cmd->size - entry_pos);
+        struct page *page = cmd->pages[entry_pos >> PAGE_SHIFT];
+
+        get_page(page);
+        spd.pages[spd.nr_pages] = page;
+        spd.partial[spd.nr_pages].offset = pg_offs;
+        spd.partial[spd.nr_pages].len = chunk;
+        spd.nr_pages++;
+        entry_pos += chunk;
+        len -= chunk;
+
+        if(entry_pos == cmd->size) {
+            uint8_t slot = (entry - cbuf->entry + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+            entry = (slot == cbuf->in_offs) ? NULL : &cbuf->entry[slot];
+            entry_pos = 0;
+        }
+    }
+    mutex_unlock(dev->lock_cc);
+
+    retval = spd.nr_pages ? splice_to_pipe(pipe, &spd) : 0;
+    if(retval > 0) {
+        *ppos = base + pos + retval;
+        atomic64_add(retval, &dev->stats.bytes_read);
+    }
+    return retval;
+}
@@ -0,0 +1,120 @@
+/**
+ * @file aesd-trace.h
+ * @brief Tracepoints of the aesdchar driver
+ *
+ * Enable with e.g. "echo 1 > /sys/kernel/tracing/events/aesdchar/enable"
+ * or "perf record -e 'aesdchar:*'".  A disabled tracepoint costs a static branch.
+ * CREATE_TRACE_POINTS is defined by main.c only.
+ *
+ * @author Madeleine Monfort
+ * @date 2024-04-18
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(_AESD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESD_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+TRACE_EVENT(aesd_write,
+    TP_PROTO(unsigned int minor, size_t count, ssize_t ret),
+    TP_ARGS(minor, count, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u count=%zu ret=%zd", __entry->minor, __entry->count, __entry->ret)
+);
+
+TRACE_EVENT(aesd_commit,
+    TP_PROTO(unsigned int minor, u64 seq, size_t size, size_t footprint),
+    TP_ARGS(minor, seq, size, footprint),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u64, seq)
+        __field(size_t, size)
+        __field(size_t, footprint)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->seq = seq;
+        __entry->size = size;
+        __entry->footprint = footprint;
+    ),
+    TP_printk("minor=%u seq=%llu size=%zu footprint=%zu", __entry->minor,
+        (unsigned long long)__entry->seq, __entry->size, __entry->footprint)
+);
+
+TRACE_EVENT(aesd_evict,
+    TP_PROTO(unsigned int minor, u64 seq, size_t size),
+    TP_ARGS(minor, seq, size),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u64, seq)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->seq = seq;
+        __entry->size = size;
+    ),
+    TP_printk("minor=%u seq=%llu size=%zu", __entry->minor,
+        (unsigned long long)__entry->seq, __entry->size)
+);
+
+TRACE_EVENT(aesd_read,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(minor, pos, count, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u pos=%lld count=%zu ret=%zd", __entry->minor,
+        __entry->pos, __entry->count, __entry->ret)
+);
+
+TRACE_EVENT(aesd_seek,
+    TP_PROTO(unsigned int minor, loff_t offset, int whence, loff_t ret),
+    TP_ARGS(minor, offset, whence, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->ret = ret;
+    ),
+    TP_printk("minor=%u offset=%lld whence=%d ret=%lld", __entry->minor,
+        __entry->offset, __entry->whence, __entry->ret)
+);
+
+#endif /* _AESD_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesd-trace
+#include <trace/define_trace.h>
@@ -33,14 +33,195 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Passed to AESDCHAR_IOCSEEKSEQ to seek to a command by its sequence number.
+ * Every committed command gets the next number of a 64-bit counter, so unlike
+ * the write_cmd of struct aesd_seekto a number keeps naming the same command
+ * after the ring wraps, and a reader can resume from the last one it saw.
+ */
+struct aesd_seekseq {
+    /**
+     * Sequence number of the command to seek into, or with AESD_SEEKSEQ_RELATIVE
+     * a signed count of commands from the one holding the current file position.
+     * The number after the newest command names the end of the data.
+     * Set to the absolute sequence number on return.
+     */
+    uint64_t seq;
+    /**
+     * The zero referenced offset within the command
+     */
+    uint32_t offset;
+    /**
+     * AESD_SEEKSEQ_* flags
+     */
+    uint32_t flags;
+};
+
+#define AESD_SEEKSEQ_RELATIVE 0x1
+
+/**
+ * Extra whence values of lseek() on aesdchar devices, reusing the numbers of
+ * SEEK_DATA and SEEK_HOLE since the kernel rejects whence values past SEEK_MAX.
+ * Both take an absolute offset and fail with ENXIO when it is at or past the end.
+ * AESD_SEEK_PREV_CMD moves to the start of the command holding that offset, so
+ * lseek(fd, pos - 1, AESD_SEEK_PREV_CMD) steps back one command from pos.
+ * AESD_SEEK_NEXT_CMD moves to the first command boundary after that offset,
+ * which is the end of the data for the last command.
+ */
+#define AESD_SEEK_PREV_CMD 3 /* SEEK_DATA */
+#define AESD_SEEK_NEXT_CMD 4 /* SEEK_HOLE */
+
+/**
+ * One command in the snapshot returned by AESDCHAR_IOCGETINDEX
+ */
+struct aesd_index_entry {
+    /**
+     * Byte offset of the command's first byte in the device
+     */
+    uint64_t offset;
+    /**
+     * Number of bytes in the command
+     */
+    uint64_t size;
+    /**
+     * Sequence number of the command, see struct aesd_seekseq
+     */
+    uint64_t seq;
+};
+
+/**
+ * Capacity of entry[] in struct aesd_index.  Fixed so the struct, and with it
+ * the number of AESDCHAR_IOCGETINDEX, doesn't depend on the ring depth a
+ * client was built with; count tells how many entries are valid.
+ */
+#define AESD_INDEX_MAX_ENTRIES 255
+
+/**
+ * A snapshot of the circular buffer metadata, copied to user space by
+ * AESDCHAR_IOCGETINDEX.  The commands are listed oldest first, the same order
+ * they are read from the device and addressed by AESDCHAR_IOCSEEKTO.
+ */
+struct aesd_index {
+    /**
+     * Incremented each time a command is committed; compare two snapshots to
+     * tell whether the offsets below are still valid
+     */
+    uint64_t generation;
+    /**
+     * Total number of bytes readable from the device
+     */
+    uint64_t total_size;
+    /**
+     * Bytes of memory holding the commands, pages or compressed chunks
+     */
+    uint64_t mem_used;
+    /**
+     * Budget mem_used is kept under (max_bytes module parameter), 0 if unlimited
+     */
+    uint64_t mem_limit;
+    /**
+     * Sequence number the next committed command will get
+     */
+    uint64_t next_seq;
+    /**
+     * Number of valid members of entry
+     */
+    uint32_t count;
+    uint32_t reserved;
+    struct aesd_index_entry entry[AESD_INDEX_MAX_ENTRIES];
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Read a snapshot of every command's offset and size, command number 2
+#define AESDCHAR_IOCGETINDEX _IOR(AESD_IOC_MAGIC, 2, struct aesd_index)
+// Seek to a command by sequence number, command number 3
+#define AESDCHAR_IOCSEEKSEQ _IOWR(AESD_IOC_MAGIC, 3, struct aesd_seekseq)
+/**
+ * Turn following on (non-zero) or off (0) for this open file, command number 4.
+ * Reads of a following file block at the end of the data until the next
+ * command is committed, unless it was opened with O_NONBLOCK, and its file
+ * position counts from the first command ever written, so it keeps its place
+ * while old commands are evicted.  Other open files are not affected.
+ */
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 4, uint32_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 4
+
+/**
+ * Capacity of slot_size[] in struct aesd_mmap_header.  Fixed so the layout
+ * doesn't depend on the ring depth a client was built with; the driver's
+ * actual depth is published in the slots field.
+ */
+#define AESD_MMAP_MAX_SLOTS 255
+
+/**
+ * Layout of the read-only view returned by mmap() on an aesdchar device.
+ *
+ * Page 0 of the mapping holds a struct aesd_mmap_header.  Each slot of the
+ * circular buffer then owns a fixed window of window_pages pages: the entry
+ * stored in slot i starts at byte offset (1 + i * window_pages) * page_size of
+ * the mapping and is contiguous there for
+ * min(slot_size[i], window_pages * page_size) bytes.  Bytes past slot_size[i]
+ * read as zero; touching a window past the last page of its entry raises SIGBUS.
+ *
+ * Entries are read oldest first starting at slot out_offs, for count slots,
+ * wrapping at slots.  The header is published under a sequence counter:
+ * read seq and retry while it is odd, copy what is needed from the header and
+ * the windows, then re-read seq and retry if it changed.  A reader that wants
+ * new data polls seq for a change.
+ */
+struct aesd_mmap_header {
+    /**
+     * AESD_MMAP_MAGIC once the header is initialized
+     */
+    uint32_t magic;
+    /**
+     * AESD_MMAP_VERSION of this layout
+     */
+    uint32_t version;
+    /**
+     * Sequence counter, odd while the header is being updated
+     */
+    uint32_t seq;
+    /**
+     * Number of slots in the circular buffer
+     */
+    uint32_t slots;
+    /**
+     * Number of pages in the window of each slot
+     */
+    uint32_t window_pages;
+    /**
+     * Page size used for the offsets above
+     */
+    uint32_t page_size;
+    /**
+     * The slot holding the oldest entry (tail)
+     */
+    uint32_t out_offs;
+    /**
+     * The slot the next entry will be written to (head)
+     */
+    uint32_t in_offs;
+    /**
+     * Number of entries in the circular buffer
+     */
+    uint32_t count;
+    uint32_t reserved;
+    /**
+     * Number of bytes in the entry stored in each slot, only the first
+     * slots entries are used
+     */
+    uint64_t slot_size[AESD_MMAP_MAX_SLOTS];
+};
+
+#define AESD_MMAP_MAGIC 0x61657364 // "aesd"
+#define AESD_MMAP_VERSION 1
 
 #endif /* AESD_IOCTL_H */
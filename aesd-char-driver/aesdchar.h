@@ -8,8 +8,10 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+#include <linux/fs.h> // struct file, for the aesd_file accessors
 #include "aesd-circular-buffer.h"
+#include "aesd-cmd.h"
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -24,14 +26,160 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/**
+ * Delay before staged per-CPU commands are drained when nothing else drains them
+ */
+#define AESD_PCPU_DRAIN_MS 10
+
+/**
+ * Commands shorter than this are never compressed
+ */
+#define AESD_Z_MIN_SIZE 256
+/**
+ * Number of decompressed chunks cached per device
+ */
+#define AESD_Z_CACHE_SIZE 4
+
+struct aesd_mmap_header;
+struct aesd_pcpu;
+struct dentry;
+struct aesd_zcache;
+struct crypto_comp;
+struct iov_iter;
+struct pipe_inode_info;
+
+/**
+ * Counters shown in debugfs, updated without any lock
+ */
+struct aesd_stats
+{
+    atomic64_t bytes_written;
+    atomic64_t bytes_read;
+    atomic64_t commits;
+    atomic64_t evictions; //commands dropped from the ring, by the entry count or the byte budget
+    atomic64_t lock_acquired; //times lock_cc was taken through aesd_lock_cc()
+    atomic64_t lock_contended; //of those, times it was already held
+};
+
 struct aesd_dev
 {
     struct aesd_circular_buffer* cbuf; //the circular buffer
-    struct aesd_buffer_entry current_command; //for handling appended writes
+    struct aesd_cmd* current_command; //for handling appended writes, NULL until first write
     struct mutex* lock_cc;
     struct mutex* lock_fpos;
+    spinlock_t lock_map; //guards cbuf changes against the mmap fault handler
+    wait_queue_head_t readq; //readers waiting for a new command
+    unsigned long nr_commits; //bumped on each commit, checked by waiting readers
+    size_t mem_used; //footprint of the commands in cbuf, guarded by lock_map
+    struct aesd_pcpu __percpu* pcpu; //per-CPU staged commands, NULL unless percpu_batch is set
+    struct list_head pending; //drained commands waiting for an earlier sequence number
+    atomic64_t next_seq; //sequence number given to the next completed command
+    u64 commit_seq; //sequence number of the next command to commit
+    u64 stream_bytes; //bytes ever committed, the stream_offs of the next command
+    struct delayed_work drain_work; //drains staged commands after the last write
+    bool persist_on; //queue commits for the segment files
+    struct file* persist_file[2]; //the two segment files, NULL when persistence is off
+    int persist_active; //index of the segment being appended to
+    loff_t persist_pos; //end of the active segment
+    struct list_head persist_queue; //committed commands not written yet
+    size_t persist_queued; //footprint of the commands in persist_queue or being written
+    spinlock_t persist_lock; //guards persist_queue and persist_queued
+    struct mutex persist_io; //serializes segment writes
+    struct delayed_work persist_work; //writes persist_queue to the active segment
+    struct crypto_comp* ztfm; //compressor, NULL when commands are stored uncompressed
+    char* zbuf; //compression output scratch buffer
+    struct aesd_zcache* zcache; //recently decompressed chunks
+    int zcache_next; //next zcache slot to reuse
+    struct mutex lock_z; //guards ztfm, zbuf and zcache
+    struct aesd_mmap_header* map_hdr; //page 0 of every mapping
+    struct inode* map_inode; //inode whose i_mapping is shared by every open file
+    unsigned int map_users; //open files attached to map_inode, guarded by lock_map
+    unsigned int map_gen[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]; //bumped when a slot's entry is replaced, guarded by lock_map
+    unsigned int minor; //minor number, used to name the device in traces and debugfs
+    struct aesd_stats stats;
+    struct dentry* debugfs_dir; //aesdchar/aesdchar<minor> in debugfs
     struct cdev cdev;     /* Char device structure      */
 };
 
+/**
+ * Per-open state, kept in filp->private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev* dev;
+    bool follow; //set by AESDCHAR_IOCFOLLOW, changed under lock_cc and lock_fpos
+};
+
+static inline struct aesd_dev *aesd_file_dev(struct file *filp)
+{
+    return ((struct aesd_file *)filp->private_data)->dev;
+}
+
+static inline bool aesd_file_follow(struct file *filp)
+{
+    return READ_ONCE(((struct aesd_file *)filp->private_data)->follow);
+}
+
+/**
+ * Takes dev->lock_cc, counting the acquisitions that had to wait for it
+ */
+static inline void aesd_lock_cc(struct aesd_dev *dev)
+{
+    atomic64_inc(&dev->stats.lock_acquired);
+    if(mutex_trylock(dev->lock_cc))
+        return;
+    atomic64_inc(&dev->stats.lock_contended);
+    mutex_lock(dev->lock_cc);
+}
+
+//main.c
+extern void aesd_commit(struct aesd_dev *dev, struct aesd_cmd *cc);
+extern size_t aesd_max_cmd_size(void);
+extern void aesd_lock_reader(struct aesd_dev *dev);
+extern loff_t aesd_pos_base(struct aesd_dev *dev, bool follow);
+extern loff_t aesd_ring_pos(loff_t pos, loff_t base);
+
+//aesd-splice.c
+extern ssize_t aesd_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+            size_t len, unsigned int flags);
+
+//aesd-debugfs.c
+extern void aesd_debugfs_root_init(void);
+extern void aesd_debugfs_root_cleanup(void);
+extern void aesd_debugfs_init(struct aesd_dev *dev);
+extern void aesd_debugfs_cleanup(struct aesd_dev *dev);
+
+//aesd-pcpu.c
+extern int aesd_pcpu_init(struct aesd_dev *dev);
+extern void aesd_pcpu_cleanup(struct aesd_dev *dev);
+extern void aesd_pcpu_commit(struct aesd_dev *dev, struct aesd_cmd *cmd);
+extern ssize_t aesd_pcpu_write(struct aesd_dev *dev, struct iov_iter *from);
+extern void aesd_pcpu_drain(struct aesd_dev *dev);
+
+//aesd-compress.c
+extern int aesd_z_init(struct aesd_dev *dev);
+extern void aesd_z_cleanup(struct aesd_dev *dev);
+extern bool aesd_z_enabled(struct aesd_dev *dev);
+extern void aesd_z_compress(struct aesd_dev *dev, struct aesd_cmd *cmd);
+extern ssize_t aesd_z_copy_to_iter(struct aesd_dev *dev, struct aesd_cmd *cmd, size_t offs,
+            struct iov_iter *to);
+extern int aesd_z_read_chunk(struct aesd_dev *dev, struct aesd_cmd *cmd, unsigned int chunk, void *dst);
+
+//aesd-persist.c
+extern int aesd_persist_init(struct aesd_dev *dev, int index);
+extern void aesd_persist_cleanup(struct aesd_dev *dev);
+extern void aesd_persist_queue(struct aesd_dev *dev, struct aesd_cmd *cmd);
+extern int aesd_persist_sync(struct aesd_dev *dev);
+extern void aesd_persist_throttle(struct aesd_dev *dev);
+
+//aesd-mmap.c
+extern int aesd_mmap_init(struct aesd_dev *dev);
+extern void aesd_mmap_cleanup(struct aesd_dev *dev);
+extern void aesd_mmap_attach(struct aesd_dev *dev, struct inode *inode, struct file *filp);
+extern void aesd_mmap_detach(struct aesd_dev *dev);
+extern void aesd_mmap_invalidate(struct aesd_dev *dev, uint8_t slot, struct aesd_cmd *cmd);
+extern void aesd_mmap_publish(struct aesd_dev *dev);
+extern int aesd_mmap(struct file *filp, struct vm_area_struct *vma);
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
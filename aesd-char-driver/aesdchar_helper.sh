@@ -31,3 +31,112 @@ make test
 strace -o straceI.txt ./ioctlTest
 
 cd ../aesd-char-driver
+
+#test follow mode past the 10 command ring, set per open file
+sudo ./aesdchar_unload
+sudo ./aesdchar_load
+if ! ../server/driverTest follow; then
+  exit 1
+fi
+
+#test the byte budget: a command that can't fit fails once, later ones still work
+sudo ./aesdchar_unload
+sudo ./aesdchar_load max_bytes=4096
+if printf '%4096s' | tr ' ' 'a' > /dev/aesdchar; then
+  echo "oversized command was accepted"
+  exit 1
+fi
+if ! echo > /dev/aesdchar || ! echo "after budget" > /dev/aesdchar; then
+  echo "writes after an oversized command failed"
+  exit 1
+fi
+if ! grep -q "after budget" /dev/aesdchar; then
+  echo "command after an oversized one is missing"
+  exit 1
+fi
+
+#test AESDCHAR_IOCSEEKTO once budget evictions wrap the ring
+sudo ./aesdchar_unload
+sudo ./aesdchar_load max_bytes=16384
+if ! ../server/driverTest seekto; then
+  exit 1
+fi
+
+#test the mmap header and windows, including windows whose slot was reused
+sudo ./aesdchar_unload
+sudo ./aesdchar_load
+if ! ../server/driverTest mmap; then
+  exit 1
+fi
+
+#test the AESDCHAR_IOCGETINDEX snapshot
+sudo ./aesdchar_unload
+sudo ./aesdchar_load
+if ! ../server/driverTest index; then
+  exit 1
+fi
+
+#test that per-CPU staging keeps the commands in write order
+sudo ./aesdchar_unload
+sudo ./aesdchar_load percpu_batch=4
+if ! ../server/driverTest pcpu; then
+  exit 1
+fi
+
+#test that the history survives a reload, including a torn last record
+sudo ./aesdchar_unload
+sudo rm -rf /tmp/aesdpersist
+mkdir -p /tmp/aesdpersist
+sudo ./aesdchar_load persist_dir=/tmp/aesdpersist
+if ! ../server/driverTest persist-write; then
+  exit 1
+fi
+sudo ./aesdchar_unload
+#a header for 100 bytes followed by only 3, as a crash mid-write leaves it
+printf 'asdR\0\0\0\0\0\0\0\0\0\0\0\0\144\0\0\0\0\0\0\0abc' | sudo tee -a /tmp/aesdpersist/aesdchar0.0.seg > /dev/null
+sudo ./aesdchar_load persist_dir=/tmp/aesdpersist
+if ! ../server/driverTest persist-read 12 || ! ../server/driverTest persist-write; then
+  exit 1
+fi
+#the commands written after the torn record replaced it
+sudo ./aesdchar_unload
+sudo ./aesdchar_load persist_dir=/tmp/aesdpersist
+if ! ../server/driverTest persist-read 24; then
+  exit 1
+fi
+
+#test that queued commands count against max_bytes: with a long interval the
+#queue is still written as soon as it holds half the budget
+sudo ./aesdchar_unload
+sudo rm -rf /tmp/aesdpersist
+mkdir -p /tmp/aesdpersist
+sudo ./aesdchar_load persist_dir=/tmp/aesdpersist persist_interval_ms=60000 max_bytes=8192
+for i in $(seq 1 20); do
+  echo "budget $i" > /dev/aesdchar
+done
+sleep 1
+if [ ! -s /tmp/aesdpersist/aesdchar0.0.seg ]; then
+  echo "queue over the budget was not written early"
+  exit 1
+fi
+
+#test that compressed commands read back unchanged
+sudo ./aesdchar_unload
+sudo ./aesdchar_load compress=lz4
+if ! ../server/driverTest compress; then
+  exit 1
+fi
+
+#test AESDCHAR_IOCSEEKSEQ
+sudo ./aesdchar_unload
+sudo ./aesdchar_load
+if ! ../server/driverTest seekseq; then
+  exit 1
+fi
+
+#test splice() out of the device
+sudo ./aesdchar_unload
+sudo ./aesdchar_load
+if ! ../server/driverTest splice; then
+  exit 1
+fi
@@ -18,15 +18,57 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h> /* kmalloc() */
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/uio.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+#define CREATE_TRACE_POINTS
+#include "aesd-trace.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
 MODULE_AUTHOR("Madeleine Monfort");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device; //allocated in init function
+
+static unsigned long max_bytes = 0;
+
+/**
+ * Sets max_bytes, at load time or through sysfs.  A budget under one page
+ * couldn't hold even a one byte command, so it is rejected.
+ */
+static int aesd_set_max_bytes(const char *val, const struct kernel_param *kp)
+{
+    unsigned long budget;
+    int rc = kstrtoul(val, 0, &budget);
+    if(rc)
+        return rc;
+    if(budget && budget < PAGE_SIZE) {
+        printk(KERN_WARNING "aesdchar: max_bytes must be 0 or at least %lu\n", PAGE_SIZE);
+        return -EINVAL;
+    }
+    WRITE_ONCE(max_bytes, budget);
+    return 0;
+}
+
+static const struct kernel_param_ops max_bytes_ops = {
+    .set = aesd_set_max_bytes,
+    .get = param_get_ulong,
+};
+module_param_cb(max_bytes, &max_bytes_ops, &max_bytes, 0644);
+MODULE_PARM_DESC(max_bytes, "Memory budget of each device's commands, oldest are evicted to stay under it, 0 for no limit, otherwise at least one page (default 0)");
+
+static int nr_devices = 1;
+module_param(nr_devices, int, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of aesdchar devices, each with its own ring (default 1)");
+
+struct aesd_dev* aesd_devices; //one per minor, allocated in init function
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
@@ -36,8 +78,15 @@ int aesd_open(struct inode *inode, struct file *filp)
     struct aesd_dev* dev;
     dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
     
-    //set the file pointer to the aesd_dev struct found from the inode
-    filp->private_data = dev;
+    //keep the aesd_dev struct found from the inode with this open's state
+    struct aesd_file* af = kzalloc(sizeof(*af), GFP_KERNEL);
+    if(!af)
+        return -ENOMEM;
+    af->dev = dev;
+    filp->private_data = af;
+    
+    //share one address_space so stale mmap windows can be invalidated
+    aesd_mmap_attach(dev, inode, filp);
     
     return 0;
 }
@@ -45,27 +94,115 @@ int aesd_open(struct inode *inode, struct file *filp)
 int aesd_release(struct inode *inode, struct file *filp)
 {
     PDEBUG("release");
-    //shouldn't need to do anything since I didn't malloc in open
+    aesd_mmap_detach(aesd_file_dev(filp));
+    kfree(filp->private_data);
     return 0;
 }
 
+/**
+ * Commits the commands still staged per CPU and, when persistence is on,
+ * writes and syncs the history now instead of after persist_interval_ms.
+ */
+int aesd_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+    struct aesd_dev* dev = aesd_file_dev(filp);
+
+    aesd_lock_reader(dev);
+    mutex_unlock(dev->lock_cc);
+    return aesd_persist_sync(dev);
+}
+
+/**
+ * Takes dev->lock_cc on behalf of a reader, first committing any commands
+ * still staged per CPU so the reader sees every completed write.
+ */
+void aesd_lock_reader(struct aesd_dev* dev)
+{
+    aesd_lock_cc(dev);
+    aesd_pcpu_drain(dev);
+}
+
+/**
+ * @return the number of bytes held in the valid entries of @param cbuf
+ * Any necessary locking must be performed by caller.
+ */
+static size_t aesd_total_size(struct aesd_circular_buffer* cbuf)
+{
+    return cbuf->total_size;
+}
+
+/**
+ * @return the file position of the oldest byte held by @param dev.
+ * For a following file (@param follow) positions are stream offsets, counted
+ * from the first command ever committed, so it keeps its place while old
+ * commands are evicted; otherwise they count from the oldest command in the ring.
+ * Any necessary locking must be performed by caller.
+ */
+loff_t aesd_pos_base(struct aesd_dev* dev, bool follow)
+{
+    return follow ? dev->stream_bytes - aesd_total_size(dev->cbuf) : 0;
+}
+
+/**
+ * @return the offset into the ring of the file position @param pos, given the
+ * position @param base of its oldest byte.  Evicted bytes map to the oldest
+ * byte still held, negative positions are left for the caller to reject.
+ */
+loff_t aesd_ring_pos(loff_t pos, loff_t base)
+{
+    if(pos < 0)
+        return pos;
+    return pos < base ? 0 : pos - base;
+}
+
+/**
+ * Finds the command boundary for AESD_SEEK_PREV_CMD or AESD_SEEK_NEXT_CMD,
+ * given by @param whence, relative to the absolute position @param offset.
+ * Any necessary locking must be performed by caller.
+ * @return the new position, -EINVAL if offset is negative,
+ *      -ENXIO if offset is at or past the end of the data
+ */
+static loff_t aesd_seek_cmd(struct aesd_circular_buffer* cbuf, loff_t offset, int whence)
+{
+    struct aesd_buffer_entry* entry;
+    size_t entry_pos = 0;
+    loff_t start;
+    
+    if(offset < 0)
+        return -EINVAL;
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(cbuf, offset, &entry_pos);
+    if(!entry)
+        return -ENXIO;
+    
+    start = offset - entry_pos;
+    if(whence == AESD_SEEK_PREV_CMD)
+        return start;
+    return start + entry->size;
+}
+
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) 
 {
-    struct aesd_dev* dev = filp->private_data;
+    struct aesd_dev* dev = aesd_file_dev(filp);
     struct aesd_circular_buffer* cbuf = dev->cbuf;
-    
-    loff_t size = 0; //set to size of full circular buffer
-    
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
-    mutex_lock(dev->lock_cc);
-    AESD_CIRCULAR_BUFFER_FOREACH(entry,cbuf,index) {
-        size = size + entry->size;
+    loff_t new_pos;
+    loff_t base;
+    loff_t end;
+    
+    //the size is tracked as entries come and go, so no walk over the ring
+    aesd_lock_reader(dev);
+    base = aesd_pos_base(dev, aesd_file_follow(filp));
+    end = base + aesd_total_size(cbuf);
+    if(whence == AESD_SEEK_PREV_CMD || whence == AESD_SEEK_NEXT_CMD) {
+        new_pos = aesd_seek_cmd(cbuf, aesd_ring_pos(offset, base), whence);
+        if(new_pos >= 0)
+            new_pos = vfs_setpos(filp, base + new_pos, end);
+    }
+    else {
+        new_pos = generic_file_llseek_size(filp, offset, whence, end, end);
     }
     mutex_unlock(dev->lock_cc);
     
-    loff_t new_pos = fixed_size_llseek(filp, offset, whence, size);
-    
+    trace_aesd_seek(dev->minor, offset, whence, new_pos);
     return new_pos;
 }
 
@@ -83,72 +220,207 @@ static long aesd_adjust_file_offset(struct file* filp, unsigned int write_cmd,
     PDEBUG("ioctl: cmd=%d and offset=%d", write_cmd, write_cmd_offset);
     long retval = 0;
     
-    struct aesd_dev* dev = filp->private_data;
+    struct aesd_dev* dev = aesd_file_dev(filp);
     struct aesd_circular_buffer* cbuf = dev->cbuf;
-    
-    //check for valid cmd
-    if(write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) 
-    {
+    struct aesd_cmd* oldest;
+    struct aesd_cmd* cmd;
+    unsigned int count;
+    
+    //hold the lock until f_pos is set so no commit or eviction moves the commands
+    aesd_lock_reader(dev);
+    
+    //check for valid cmd, budget eviction can leave in_offs behind out_offs
+    if(cbuf->full)
+        count = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    else
+        count = (cbuf->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - cbuf->out_offs)
+                    % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    if(write_cmd >= count) {
         retval = -EINVAL;
-        goto end;
+        goto unlock;
     }
-    //locking
-    mutex_lock(dev->lock_cc);
-    uint8_t out_o = cbuf->out_offs;
-    uint8_t in_o = cbuf->in_offs;
-    bool full = cbuf->full;
-    mutex_unlock(dev->lock_cc);
     
-    uint8_t bufs = in_o - out_o;
-    if(full) bufs = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    if(write_cmd > bufs) {
+    //check for valid offset
+    oldest = cbuf->entry[cbuf->out_offs].priv;
+    cmd = cbuf->entry[(cbuf->out_offs + write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].priv;
+    if(write_cmd_offset > cmd->size) {
         retval = -EINVAL;
-        goto end;
+        goto unlock;
     }
     
-    //check for valid offset
-    uint8_t cmd_index = out_o + write_cmd;
-    if(cmd_index >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-        cmd_index = cmd_index - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
+    //the commands' stream offsets give the start of write_cmd without walking the ring
+    mutex_lock(dev->lock_fpos);
+    filp->f_pos = aesd_pos_base(dev, aesd_file_follow(filp)) + cmd->stream_offs - oldest->stream_offs
+                    + write_cmd_offset;
+    mutex_unlock(dev->lock_fpos);
     
-    uint8_t cmd_size = cbuf->entry[cmd_index].size;
-    if(write_cmd_offset > cmd_size) {
-        retval = -EINVAL;
-        goto end;
+unlock:
+    mutex_unlock(dev->lock_cc);
+    return retval;
+}
+
+/**
+ * Finds the command with sequence number @param seq in @param cbuf.
+ * Commands are committed in sequence order, so its slot is normally the
+ * distance from the oldest command's number; the ring is only searched if a
+ * restored history left a gap in the numbers.
+ * Any necessary locking must be performed by caller.
+ * @return the command, or NULL if it is not in the ring
+ */
+static struct aesd_cmd* aesd_find_seq(struct aesd_circular_buffer* cbuf, u64 seq)
+{
+    struct aesd_cmd* oldest = cbuf->entry[cbuf->out_offs].priv;
+    struct aesd_cmd* cmd;
+    uint8_t i;
+    
+    if((cbuf->in_offs == cbuf->out_offs) && !cbuf->full)
+        return NULL;
+    if(seq < oldest->seq)
+        return NULL;
+    if(seq - oldest->seq < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        i = (cbuf->out_offs + (seq - oldest->seq)) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        cmd = cbuf->entry[i].priv;
+        if(cmd && cmd->seq == seq)
+            return cmd;
     }
     
-    //calculate start offset to write_cmd
-    struct aesd_buffer_entry *entry;
-    uint8_t i = out_o;
-    size_t new_offs = 0;
-    while(i != cmd_index) {
-    	//set entry
-    	entry = &(cbuf->entry[i]);
-        
-        new_offs = new_offs + entry->size;
-        
-        //handle wrap-around
-        if(i == (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1))
-            i = 0;
-        else 
-            i++;
+    i = cbuf->out_offs;
+    do {
+        cmd = cbuf->entry[i].priv;
+        if(cmd->seq == seq)
+            return cmd;
+        i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    } while(i != cbuf->in_offs);
+    return NULL;
+}
+
+/**
+ * Sets the file offset of @param filp to the command and offset described
+ * by @param seekseq, and stores the command's absolute sequence number in it.
+ * @return 0 if successful, negative if error occurred:
+ *      -ENODATA if the command was already evicted
+ *      -EINVAL if the command wasn't committed yet or the offset is out of range
+ */
+static long aesd_seek_seq(struct file* filp, struct aesd_seekseq* seekseq)
+{
+    struct aesd_dev* dev = aesd_file_dev(filp);
+    struct aesd_circular_buffer* cbuf = dev->cbuf;
+    struct aesd_buffer_entry* entry;
+    struct aesd_cmd* oldest;
+    struct aesd_cmd* cmd;
+    size_t entry_pos;
+    u64 seq = seekseq->seq;
+    loff_t new_offs;
+    loff_t base;
+    long retval = 0;
+    
+    aesd_lock_reader(dev);
+    oldest = cbuf->entry[cbuf->out_offs].priv;
+    base = aesd_pos_base(dev, aesd_file_follow(filp));
+    if(seekseq->flags & AESD_SEEKSEQ_RELATIVE) {
+        //count from the command being read, or from the end of the data
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(cbuf, aesd_ring_pos(filp->f_pos, base), &entry_pos);
+        seq = entry ? ((struct aesd_cmd*)entry->priv)->seq : dev->commit_seq;
+        seq += (s64)seekseq->seq;
     }
     
-    //add write_cmd_offset
-    new_offs = new_offs + write_cmd_offset;
+    if(seq == dev->commit_seq) {
+        //the next command to be written starts at the end of the data
+        if(seekseq->offset != 0) {
+            retval = -EINVAL;
+            goto unlock;
+        }
+        new_offs = base + aesd_total_size(cbuf);
+    }
+    else {
+        if(seq > dev->commit_seq) {
+            retval = -EINVAL;
+            goto unlock;
+        }
+        cmd = aesd_find_seq(cbuf, seq);
+        if(!cmd) {
+            retval = -ENODATA;
+            goto unlock;
+        }
+        if(seekseq->offset > cmd->size) {
+            retval = -EINVAL;
+            goto unlock;
+        }
+        //a found command means the ring isn't empty, so oldest is valid
+        new_offs = base + cmd->stream_offs - oldest->stream_offs + seekseq->offset;
+    }
     
-    //save output to filp->f_pos
     mutex_lock(dev->lock_fpos);
     filp->f_pos = new_offs;
     mutex_unlock(dev->lock_fpos);
+    seekseq->seq = seq;
     
-    retval = 0;
-    
-end:
+unlock:
+    mutex_unlock(dev->lock_cc);
     return retval;
 }
 
+/**
+ * Fill @param index with the offset and size of every command in @param dev
+ * @return 0, the snapshot can't fail
+ */
+static long aesd_get_index(struct aesd_dev* dev, struct aesd_index* index)
+{
+    struct aesd_circular_buffer* cbuf = dev->cbuf;
+    uint64_t offset = 0;
+    uint32_t count = 0;
+    
+    BUILD_BUG_ON(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED > AESD_INDEX_MAX_ENTRIES);
+    memset(index, 0, sizeof(*index));
+    
+    aesd_lock_reader(dev);
+    if((cbuf->in_offs != cbuf->out_offs) || cbuf->full) {
+        uint8_t i = cbuf->out_offs;
+        do {
+            index->entry[count].offset = offset;
+            index->entry[count].size = cbuf->entry[i].size;
+            index->entry[count].seq = ((struct aesd_cmd*)cbuf->entry[i].priv)->seq;
+            offset += cbuf->entry[i].size;
+            count++;
+            i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        } while(i != cbuf->in_offs);
+    }
+    index->generation = dev->nr_commits;
+    index->mem_used = dev->mem_used;
+    index->mem_limit = max_bytes;
+    index->next_seq = dev->commit_seq;
+    mutex_unlock(dev->lock_cc);
+    
+    index->total_size = offset;
+    index->count = count;
+    return 0;
+}
+
+/**
+ * Turns following on or off for @param filp as given by @param on, moving its
+ * file position to the same byte in the new numbering.
+ * @return 0, switching can't fail
+ */
+static long aesd_set_follow(struct file* filp, bool on)
+{
+    struct aesd_dev* dev = aesd_file_dev(filp);
+    struct aesd_file* af = filp->private_data;
+    loff_t base;
+    loff_t pos;
+    
+    aesd_lock_reader(dev);
+    mutex_lock(dev->lock_fpos);
+    if(af->follow != on) {
+        base = aesd_pos_base(dev, af->follow);
+        pos = min_t(loff_t, aesd_ring_pos(filp->f_pos, base), aesd_total_size(dev->cbuf));
+        WRITE_ONCE(af->follow, on);
+        filp->f_pos = aesd_pos_base(dev, on) + pos;
+    }
+    mutex_unlock(dev->lock_fpos);
+    mutex_unlock(dev->lock_cc);
+    return 0;
+}
+
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     long retval = 0;
@@ -170,6 +442,44 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             }
             break;
         }
+        case AESDCHAR_IOCSEEKSEQ:
+        {
+            struct aesd_seekseq seekseq;
+            if( copy_from_user(&seekseq, (const void __user *)arg, sizeof(seekseq)) != 0 ) {
+                retval = -EFAULT;
+                break;
+            }
+            retval = aesd_seek_seq(filp, &seekseq);
+            if( retval == 0 && copy_to_user((void __user *)arg, &seekseq, sizeof(seekseq)) != 0 ) {
+                retval = -EFAULT;
+            }
+            break;
+        }
+        case AESDCHAR_IOCFOLLOW:
+        {
+            uint32_t on;
+            if( copy_from_user(&on, (const void __user *)arg, sizeof(on)) != 0 ) {
+                retval = -EFAULT;
+            }
+            else {
+                retval = aesd_set_follow(filp, on != 0);
+            }
+            break;
+        }
+        case AESDCHAR_IOCGETINDEX:
+        {
+            struct aesd_index* index = kmalloc(sizeof(*index), GFP_KERNEL);
+            if(!index) {
+                retval = -ENOMEM;
+                break;
+            }
+            retval = aesd_get_index(aesd_file_dev(filp), index);
+            if( copy_to_user((void __user *)arg, index, sizeof(*index)) != 0 ) {
+                retval = -EFAULT;
+            }
+            kfree(index);
+            break;
+        }
         default:  
 	    return -ENOTTY;
     }
@@ -177,60 +487,197 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return retval;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Fills @param to with commands starting at iocb->ki_pos, continuing into the
+ * following commands until the iterator is full or the data ends, all under
+ * one acquisition of lock_cc.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
+    struct file *filp = iocb->ki_filp;
+    struct aesd_dev* dev = aesd_file_dev(filp);
+    struct aesd_circular_buffer* cbuf = dev->cbuf;
+    size_t count = iov_iter_count(to);
+    loff_t pos = iocb->ki_pos;
+    bool follow = aesd_file_follow(filp);
+    loff_t base;
     ssize_t retval = 0;
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    size_t copied = 0;
+    PDEBUG("read %zu bytes with offset %lld",count,pos);
     
     if(count == 0) goto end;
     
-    //get the circular buffer (get device struct)
-    struct aesd_dev* dev = filp->private_data;
-    struct aesd_circular_buffer* cbuf = dev->cbuf;
-    
     //get entry at fpos
     size_t entry_pos = 0;
     
-    mutex_lock(dev->lock_cc);
-    struct aesd_buffer_entry* entry = aesd_circular_buffer_find_entry_offset_for_fpos(cbuf, *f_pos, &entry_pos);
-    mutex_unlock(dev->lock_cc);
+    //hold the lock for the copy so a concurrent write can't evict the entry
+    aesd_lock_reader(dev);
+    base = aesd_pos_base(dev, follow);
+    struct aesd_buffer_entry* entry = aesd_circular_buffer_find_entry_offset_for_fpos(cbuf, aesd_ring_pos(pos, base), &entry_pos);
     
-    //do error checking
-    if(!entry) {
-        retval = 0; //end of file reached
-        goto end;
+    //a following file waits at the end of the data for the next commit
+    while(!entry && follow) {
+        unsigned long seen = dev->nr_commits;
+        mutex_unlock(dev->lock_cc);
+        
+        if(filp->f_flags & O_NONBLOCK) {
+            retval = -EAGAIN;
+            goto end;
+        }
+        if(wait_event_interruptible(dev->readq, READ_ONCE(dev->nr_commits) != seen)) {
+            retval = -ERESTARTSYS;
+            goto end;
+        }
+        
+        aesd_lock_reader(dev);
+        base = aesd_pos_base(dev, follow);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(cbuf, aesd_ring_pos(pos, base), &entry_pos);
     }
-    char* tmp_ptr = entry->buffptr;
-
-    //do size math
-    size_t new_size = entry->size - entry_pos; 
-    if(count < new_size)
-        new_size = count;
     
-    //copy data to user
-    tmp_ptr = tmp_ptr + entry_pos;
-    if(copy_to_user(buf, tmp_ptr, new_size)) {
-        retval = -EFAULT;
-        goto end;
+    //copy data to user, across as many entries (and their pages or compressed chunks) as fit
+    while(entry && iov_iter_count(to)) {
+        uint8_t slot = entry - cbuf->entry;
+        
+        retval = aesd_z_copy_to_iter(dev, entry->priv, entry_pos, to);
+        if(retval < 0)
+            break;
+        copied += retval;
+        //a short copy means the iterator is full or faulted
+        if(entry_pos + retval < entry->size)
+            break;
+        
+        slot = (slot + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        entry = (slot == cbuf->in_offs) ? NULL : &cbuf->entry[slot];
+        entry_pos = 0;
     }
+    mutex_unlock(dev->lock_cc);
     
-    //update fpos
-    *f_pos += new_size;
-    
-    //update retval
-    retval = new_size;
+    //report what was copied before any error
+    if(copied) {
+        retval = copied;
+        //a follower whose bytes were evicted skips to the oldest ones left
+        iocb->ki_pos = base + aesd_ring_pos(pos, base) + copied;
+        atomic64_add(copied, &dev->stats.bytes_read);
+    }
     
 end:
-    PDEBUG("read: fpos=%lld, retval=%ld", *f_pos, retval);
+    PDEBUG("read: fpos=%lld, retval=%ld", iocb->ki_pos, retval);
+    trace_aesd_read(dev->minor, pos, count, retval);
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * @return the largest command that fits under max_bytes, SIZE_MAX if there is no limit
+ */
+size_t aesd_max_cmd_size(void)
 {
+    unsigned long budget = READ_ONCE(max_bytes);
+    return budget ? round_down(budget, PAGE_SIZE) : SIZE_MAX;
+}
+
+/**
+ * Adds the completed command @param cc to the circular buffer of @param dev,
+ * freeing the entries it displaces, and republishes the mmap header.
+ * A full buffer loses its oldest entry, and with max_bytes set the oldest
+ * entries are evicted until the footprint of cc fits the budget.
+ * cc->seq must already be set.  Caller must hold dev->lock_cc.
+ */
+void aesd_commit(struct aesd_dev* dev, struct aesd_cmd* cc)
+{
+    struct aesd_circular_buffer* cbuf = dev->cbuf;
+    struct aesd_cmd* evicted[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint8_t evicted_slot[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    int nr_evicted = 0;
+    int i;
+    
+    aesd_cmd_seal(cc);
+    aesd_z_compress(dev, cc);
+    cc->footprint = aesd_cmd_footprint(cc);
+    cc->stream_offs = dev->stream_bytes;
+    dev->stream_bytes += cc->size;
+    dev->commit_seq = cc->seq + 1;
+    
+    //perform a write operation on cbuf, the entry keeps the staged pages
+    struct aesd_buffer_entry entry;
+    entry.buffptr = NULL;
+    entry.size = cc->size;
+    entry.priv = cc;
+    
+    spin_lock(&dev->lock_map);
+    //byte budget: evict the oldest commands until cc fits
+    while(max_bytes && dev->mem_used + cc->footprint > max_bytes) {
+        uint8_t slot = cbuf->out_offs;
+        struct aesd_buffer_entry* old = aesd_circular_buffer_remove_entry(cbuf);
+        if(!old)
+            break;
+        evicted_slot[nr_evicted] = slot;
+        evicted[nr_evicted++] = old->priv;
+        dev->map_gen[slot]++;
+        dev->mem_used -= ((struct aesd_cmd*)old->priv)->footprint;
+        old->priv = NULL;
+        old->size = 0;
+    }
+    //handle overwriting freeing
+    if(cbuf->full) {
+        evicted_slot[nr_evicted] = cbuf->in_offs;
+        evicted[nr_evicted] = cbuf->entry[cbuf->in_offs].priv;
+        dev->map_gen[cbuf->in_offs]++;
+        dev->mem_used -= evicted[nr_evicted++]->footprint;
+    }
+    aesd_circular_buffer_add_entry(cbuf, &entry);
+    dev->mem_used += cc->footprint;
+    spin_unlock(&dev->lock_map);
+    
+    //drop the old entries' pages from any mappings before freeing them
+    for(i = 0; i < nr_evicted; i++) {
+        aesd_mmap_invalidate(dev, evicted_slot[i], evicted[i]);
+        trace_aesd_evict(dev->minor, evicted[i]->seq, evicted[i]->size);
+        aesd_cmd_put(evicted[i]);
+    }
+    atomic64_add(nr_evicted, &dev->stats.evictions);
+    atomic64_inc(&dev->stats.commits);
+    trace_aesd_commit(dev->minor, cc->seq, cc->size, cc->footprint);
+    aesd_mmap_publish(dev);
+    aesd_persist_queue(dev, cc);
+    
+    //wake pollers and readers blocked at the end of the data
+    WRITE_ONCE(dev->nr_commits, dev->nr_commits + 1);
+    wake_up_interruptible_poll(&dev->readq, EPOLLIN | EPOLLRDNORM);
+}
+
+/**
+ * Reports @param filp readable when there is data past its file position.
+ * Writes never block, so the device is always writable.
+ */
+__poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct aesd_dev* dev = aesd_file_dev(filp);
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    
+    poll_wait(filp, &dev->readq, wait);
+    
+    aesd_lock_reader(dev);
+    if(filp->f_pos < aesd_pos_base(dev, aesd_file_follow(filp)) + aesd_total_size(dev->cbuf))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    mutex_unlock(dev->lock_cc);
+    
+    return mask;
+}
+
+/**
+ * Appends the whole of @param from to the device under one acquisition of
+ * lock_cc, committing a separate command at every '\n'.  Bytes after the last
+ * '\n' stay staged for the next write.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct aesd_dev* dev = aesd_file_dev(iocb->ki_filp);
+    size_t count = iov_iter_count(from);
+    size_t limit = aesd_max_cmd_size();
     ssize_t retval = -ENOMEM;
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+    size_t done = 0;
+    bool eol;
+    PDEBUG("write %zu bytes with offset %lld",count,iocb->ki_pos);
     
     //error correction
     if(count <= 0) {
@@ -238,181 +685,281 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
         goto end;
     }
     
-    //get the circular buffer (get device struct)
-    struct aesd_dev* dev = filp->private_data;
-    struct aesd_circular_buffer* cbuf = dev->cbuf;
-    struct aesd_buffer_entry cc = dev->current_command;
-    
-    //grab end of previous command
-    size_t old_pos = cc.size;
-    
-    //update the current command entry
-    cc.size += count;
-    PDEBUG("write: old size=%ld new=%ld",old_pos,cc.size);
-    //temp command
-    mutex_lock(dev->lock_cc);
-    char* command_buf = krealloc(cc.buffptr, cc.size, GFP_KERNEL); //need to set up the buffer for the command
-    mutex_unlock(dev->lock_cc);
-    if(!command_buf) {
-        retval = -ENOMEM;
-        goto end;
+    //per-CPU mode: whole commands are staged without lock_cc
+    if(dev->pcpu && !READ_ONCE(dev->current_command)) {
+        retval = aesd_pcpu_write(dev, from);
+        if(retval < 0 || !iov_iter_count(from))
+            goto end;
+        done = retval;
     }
-    //mem handling
-    char* tmp_ptr = command_buf;
     
-    //find new location
-    command_buf += old_pos;
-    
-    if(copy_from_user(command_buf, buf, count)) { //!= 0
-        retval = -EFAULT;
-        goto fail_fill;
-    }
-    
-    //check if cc was full command (end in '\n')
-    command_buf = tmp_ptr + cc.size - 1;
-    if(*command_buf == '\n') {
-        mutex_lock(dev->lock_cc);
-        //handle overwriting freeing
-        if(cbuf->full) {
-            uint8_t index = cbuf->in_offs;
-            struct aesd_buffer_entry* e_overwrite = &(cbuf->entry[index]);
-            if(e_overwrite) {
-                kfree(e_overwrite->buffptr);
+    aesd_lock_cc(dev);
+    while(iov_iter_count(from)) {
+        //start a new command if there isn't one pending
+        if(!dev->current_command) {
+            dev->current_command = aesd_cmd_alloc();
+            if(!dev->current_command) {
+                retval = -ENOMEM;
+                break;
             }
         }
+        struct aesd_cmd* cc = dev->current_command;
         
-        //perform a write operation on cbuf
-        cc.buffptr = tmp_ptr;
-        aesd_circular_buffer_add_entry(cbuf, &cc);
+        //append to the staged pages up to the next '\n', nothing already staged is moved
+        retval = aesd_cmd_append_iter(cc, from, limit, &eol);
+        if(retval < 0)
+            break;
         
-        //reset the current command
-        dev->current_command.buffptr = NULL;
-        dev->current_command.size = 0;
-        mutex_unlock(dev->lock_cc);
+        //a command that fills the whole budget could never be committed,
+        //drop it so the next write starts a new one
+        if(!eol && cc->size >= limit) {
+            aesd_cmd_put(cc);
+            dev->current_command = NULL;
+            retval = -EFBIG;
+            break;
+        }
+        done += retval;
+        atomic64_add(retval, &dev->stats.bytes_written);
+        PDEBUG("write: staged size=%zu",cc->size);
         
+        //check if cc was full command (end in '\n')
+        if(eol) {
+            if(dev->pcpu) {
+                //keep the order of commands still staged on other CPUs
+                aesd_pcpu_commit(dev, cc);
+            }
+            else {
+                cc->seq = atomic64_inc_return(&dev->next_seq) - 1;
+                aesd_commit(dev, cc);
+            }
+            
+            //reset the current command
+            dev->current_command = NULL;
+        }
     }
-    else {
-        mutex_lock(dev->lock_cc);
-        cc.buffptr = tmp_ptr;
-        dev->current_command = cc;
-        mutex_unlock(dev->lock_cc);
-    }
-    
-    retval = count;
+    mutex_unlock(dev->lock_cc);
     
-    goto end;
+    //report what was written before any error, a dropped command isn't counted
+    if(done)
+        retval = done;
     
-
-fail_fill:
-    kfree(command_buf);
 end:
+    aesd_persist_throttle(dev);
+    trace_aesd_write(dev->minor, count, retval);
     return retval;
 }
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .llseek =   aesd_llseek,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter = aesd_read_iter,
+    .write_iter = aesd_write_iter,
+    .splice_read = aesd_splice_read,
+    .splice_write = iter_file_splice_write,
     .open =     aesd_open,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
     .release =  aesd_release,
+    .fsync =    aesd_fsync,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
     }
     return err;
 }
 
-
-
-int aesd_init_module(void)
+/**
+ * Allocates and initializes the circular buffer and locks of @param dev,
+ * device number @param index, and restores its persisted history.
+ * @return 0 if successful, negative otherwise (nothing is left allocated)
+ */
+static int aesd_dev_init(struct aesd_dev *dev, int index)
 {
-    dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
-            "aesdchar");
-    aesd_major = MAJOR(dev);
-    if (result < 0) {
-        printk(KERN_WARNING "Can't get major %d\n", aesd_major);
-        return result;
-    }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
+    memset(dev,0,sizeof(struct aesd_dev));
+    dev->minor = aesd_minor + index;
 
-     //init circular buffer dynamically
-     aesd_device.cbuf = kmalloc(sizeof(struct aesd_circular_buffer), GFP_KERNEL);
-     if(!aesd_device.cbuf) {
+    //init circular buffer dynamically
+    dev->cbuf = kmalloc(sizeof(struct aesd_circular_buffer), GFP_KERNEL);
+    if(!dev->cbuf) {
         result = -ENOMEM;
         goto end;
-     }
+    }
      
-     //allocate mutexes dynamically
-     aesd_device.lock_cc = kmalloc(sizeof(struct mutex), GFP_KERNEL);
-     if(!aesd_device.lock_cc) {
+    //allocate mutexes dynamically
+    dev->lock_cc = kmalloc(sizeof(struct mutex), GFP_KERNEL);
+    if(!dev->lock_cc) {
         result = -ENOMEM;
         goto endlc;
-     }
-     aesd_device.lock_fpos = kmalloc(sizeof(struct mutex), GFP_KERNEL);
-     if(!aesd_device.lock_fpos) {
+    }
+    dev->lock_fpos = kmalloc(sizeof(struct mutex), GFP_KERNEL);
+    if(!dev->lock_fpos) {
         result = -ENOMEM;
         goto endlf; 
-     }
+    }
      
-     aesd_circular_buffer_init(aesd_device.cbuf);
+    //header page for mmap
+    result = aesd_mmap_init(dev);
+    if(result)
+        goto endmap;
      
-     //init the mutexes
-     mutex_init(aesd_device.lock_cc);
-     mutex_init(aesd_device.lock_fpos);
-
-    result = aesd_setup_cdev(&aesd_device);
-
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
-    }
-    return result;
+    //compressor, only allocated when compress is set
+    result = aesd_z_init(dev);
+    if(result)
+        goto endz;
+     
+    //per-CPU staging lists, only allocated when percpu_batch is set
+    result = aesd_pcpu_init(dev);
+    if(result)
+        goto endpcpu;
+     
+    aesd_circular_buffer_init(dev->cbuf);
+     
+    //init the mutexes
+    mutex_init(dev->lock_cc);
+    mutex_init(dev->lock_fpos);
+    init_waitqueue_head(&dev->readq);
+    
+    //rebuild the ring from the segment files, when persistence is on
+    result = aesd_persist_init(dev, index);
+    if(result)
+        goto endpersist;
+    
+    //statistics, failing to create them is not an error
+    aesd_debugfs_init(dev);
+    return 0;
 
+endpersist:
+    aesd_pcpu_cleanup(dev);
+    mutex_destroy(dev->lock_cc);
+    mutex_destroy(dev->lock_fpos);
+endpcpu:
+    aesd_z_cleanup(dev);
+endz:
+    aesd_mmap_cleanup(dev);
+endmap:
+    kfree(dev->lock_fpos);
 endlf:
-    kfree(aesd_device.lock_cc);
+    kfree(dev->lock_cc);
 endlc:
-    kfree(aesd_device.cbuf);
+    kfree(dev->cbuf);
 end:
     return result;
 }
 
-void aesd_cleanup_module(void)
+/**
+ * Frees everything allocated by aesd_dev_init() and every command stored in @param dev
+ */
+static void aesd_dev_cleanup(struct aesd_dev *dev)
 {
-    dev_t devno = MKDEV(aesd_major, aesd_minor);
-
-    cdev_del(&aesd_device.cdev);
-
+    aesd_debugfs_cleanup(dev);
+    //commit anything still staged per CPU before freeing the ring
+    aesd_pcpu_cleanup(dev);
+    //then write what hasn't reached the segment files yet
+    aesd_persist_cleanup(dev);
+    
     //free the circular buffer
     uint8_t index = 0;
     struct aesd_buffer_entry *entry;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry,aesd_device.cbuf,index) {
+    AESD_CIRCULAR_BUFFER_FOREACH(entry,dev->cbuf,index) {
         //free each entry and it's pointers
-        kfree(entry->buffptr);
+        aesd_cmd_put(entry->priv);
     }
-    kfree(aesd_device.cbuf);
+    kfree(dev->cbuf);
     
     //free the entry if it exists
-    if(aesd_device.current_command.size > 0)
-        kfree(aesd_device.current_command.buffptr);
+    aesd_cmd_put(dev->current_command);
+    aesd_z_cleanup(dev);
+    aesd_mmap_cleanup(dev);
     
     //release the mutexes?
-    mutex_destroy(aesd_device.lock_cc);
-    mutex_destroy(aesd_device.lock_fpos);
-    kfree(aesd_device.lock_cc);
-    kfree(aesd_device.lock_fpos);
+    mutex_destroy(dev->lock_cc);
+    mutex_destroy(dev->lock_fpos);
+    kfree(dev->lock_cc);
+    kfree(dev->lock_fpos);
+}
+
+int aesd_init_module(void)
+{
+    dev_t dev = 0;
+    int result;
+    int i;
+    
+    if(nr_devices < 1) {
+        printk(KERN_WARNING "aesdchar: nr_devices must be at least 1\n");
+        return -EINVAL;
+    }
+    result = alloc_chrdev_region(&dev, aesd_minor, nr_devices,
+            "aesdchar");
+    aesd_major = MAJOR(dev);
+    if (result < 0) {
+        printk(KERN_WARNING "Can't get major %d\n", aesd_major);
+        return result;
+    }
+    
+    //slab cache for command headers, shared by every device
+    result = aesd_cmd_cache_init();
+    if(result)
+        goto end;
+    
+    aesd_devices = kcalloc(nr_devices, sizeof(struct aesd_dev), GFP_KERNEL);
+    if(!aesd_devices) {
+        result = -ENOMEM;
+        goto endcache;
+    }
+    aesd_debugfs_root_init();
+    
+    //each minor gets its own ring, staging command and locks
+    for(i = 0; i < nr_devices; i++) {
+        result = aesd_dev_init(&aesd_devices[i], i);
+        if(result)
+            goto enddev;
+        result = aesd_setup_cdev(&aesd_devices[i], i);
+        if(result) {
+            aesd_dev_cleanup(&aesd_devices[i]);
+            goto enddev;
+        }
+    }
+    return 0;
+
+enddev:
+    while(i-- > 0) {
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_dev_cleanup(&aesd_devices[i]);
+    }
+    kfree(aesd_devices);
+    aesd_debugfs_root_cleanup();
+endcache:
+    aesd_cmd_cache_destroy();
+end:
+    unregister_chrdev_region(dev, nr_devices);
+    return result;
+}
+
+void aesd_cleanup_module(void)
+{
+    dev_t devno = MKDEV(aesd_major, aesd_minor);
+    int i;
+
+    for(i = 0; i < nr_devices; i++) {
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_dev_cleanup(&aesd_devices[i]);
+    }
+    kfree(aesd_devices);
+    aesd_debugfs_root_cleanup();
+    aesd_cmd_cache_destroy();
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, nr_devices);
 }
 
 
@@ -0,0 +1,209 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Micro-benchmarks of the aesd circular buffer primitives
+ *
+ * Measures aesd_circular_buffer_add_entry() and
+ * aesd_circular_buffer_find_entry_offset_for_fpos() for several entry size
+ * distributions and fpos access patterns, on one ring (hot in cache) and on
+ * many rings visited round robin (cold).  The ring depth is a compile time
+ * constant, so CMake builds one executable per depth.
+ *
+ * Prints ns/op and, when perf_event_open() is permitted, cache misses/op.
+ *
+ * Usage: circular-buffer-bench-<depth> [ops per case]
+ *
+ * @author Madeleine Monfort
+ * @date 2024-04-25
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define DEPTH AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define DEFAULT_OPS 2000000
+#define COLD_RINGS 4096 //enough rings to push the working set out of L2
+#define FPOS_TABLE 4096 //precomputed positions, so the generator isn't measured
+
+enum size_dist { DIST_FIXED, DIST_UNIFORM, DIST_BIMODAL, DIST_COUNT };
+static const char* dist_name[DIST_COUNT] = { "fixed16", "uniform1-256", "bimodal16/4096" };
+
+enum pattern { PAT_SEQ, PAT_RANDOM, PAT_TAIL, PAT_COUNT };
+static const char* pattern_name[PAT_COUNT] = { "seq", "random", "tail" };
+
+static const char payload[4096]; //every entry points here, find never reads it
+static volatile size_t sink; //keeps results alive
+
+/* XORSHIFT
+ * Description: small deterministic PRNG, so runs are comparable
+ */
+static uint64_t rng_state = 88172645463325252ull;
+static uint64_t xorshift(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static size_t entry_size(enum size_dist dist) {
+	switch(dist) {
+		case DIST_FIXED: return 16;
+		case DIST_UNIFORM: return 1 + xorshift() % 256;
+		default: return (xorshift() % 8) ? 16 : 4096;
+	}
+}
+
+//-------------------------PERF COUNTERS-------------------------
+static int perf_fd = -1;
+
+static void perf_open(void) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_start(void) {
+	if(perf_fd < 0) return;
+	ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+/* PERF_STOP
+ * Output: cache misses since perf_start(), or -1 if counters aren't available
+ */
+static long long perf_stop(void) {
+	long long count = -1;
+	if(perf_fd < 0) return -1;
+	ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+	if(read(perf_fd, &count, sizeof(count)) != sizeof(count))
+		return -1;
+	return count;
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* op, const char* dist, const char* pattern, int rings,
+		long ops, double ns, long long misses) {
+	printf("%5d %-6s %-15s %-7s %5s %9.2f", DEPTH, op, dist, pattern,
+		rings == 1 ? "hot" : "cold", ns / ops);
+	if(misses >= 0)
+		printf(" %9.3f\n", (double)misses / ops);
+	else
+		printf(" %9s\n", "n/a");
+}
+
+//-------------------------BENCHMARKS-------------------------
+/* FILL
+ * Description: fills every ring with DEPTH entries drawn from dist
+ * Output: total size of the last ring (all rings hold the same sizes)
+ */
+static size_t fill(struct aesd_circular_buffer* rings, int nr_rings, enum size_dist dist) {
+	size_t sizes[DEPTH];
+	size_t total = 0;
+	for(int i = 0; i < DEPTH; i++) {
+		sizes[i] = entry_size(dist);
+		total += sizes[i];
+	}
+	for(int r = 0; r < nr_rings; r++) {
+		aesd_circular_buffer_init(&rings[r]);
+		for(int i = 0; i < DEPTH; i++) {
+			struct aesd_buffer_entry entry = { payload, sizes[i], NULL };
+			aesd_circular_buffer_add_entry(&rings[r], &entry);
+		}
+	}
+	return total;
+}
+
+static void bench_add(struct aesd_circular_buffer* rings, int nr_rings, enum size_dist dist, long ops) {
+	struct aesd_buffer_entry entries[FPOS_TABLE];
+	for(int i = 0; i < FPOS_TABLE; i++) {
+		entries[i].buffptr = payload;
+		entries[i].size = entry_size(dist);
+		entries[i].priv = NULL;
+	}
+	fill(rings, nr_rings, dist);
+
+	perf_start();
+	double start = now_ns();
+	for(long n = 0; n < ops; n++)
+		aesd_circular_buffer_add_entry(&rings[n % nr_rings], &entries[n % FPOS_TABLE]);
+	double ns = now_ns() - start;
+	report("add", dist_name[dist], "-", nr_rings, ops, ns, perf_stop());
+}
+
+static void bench_find(struct aesd_circular_buffer* rings, int nr_rings, enum size_dist dist,
+		enum pattern pattern, long ops) {
+	static size_t fpos[FPOS_TABLE];
+	size_t total = fill(rings, nr_rings, dist);
+	size_t last = rings[0].entry[(rings[0].in_offs + DEPTH - 1) % DEPTH].size;
+
+	for(int i = 0; i < FPOS_TABLE; i++) {
+		switch(pattern) {
+			case PAT_SEQ: fpos[i] = (size_t)i * 7 % total; break; //a reader stepping through the data
+			case PAT_RANDOM: fpos[i] = xorshift() % total; break;
+			default: fpos[i] = total - 1 - xorshift() % last; break; //a follower near the end
+		}
+	}
+
+	perf_start();
+	double start = now_ns();
+	for(long n = 0; n < ops; n++) {
+		size_t entry_offs;
+		struct aesd_buffer_entry* entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+			&rings[n % nr_rings], fpos[n % FPOS_TABLE], &entry_offs);
+		sink += entry ? entry_offs : 0;
+	}
+	double ns = now_ns() - start;
+	report("find", dist_name[dist], pattern_name[pattern], nr_rings, ops, ns, perf_stop());
+}
+
+int main(int argc, char* argv[]) {
+	long ops = argc > 1 ? atol(argv[1]) : DEFAULT_OPS;
+	if(ops <= 0) {
+		fprintf(stderr, "Usage: %s [ops per case]\n", argv[0]);
+		return 1;
+	}
+
+	struct aesd_circular_buffer* rings = calloc(COLD_RINGS, sizeof(*rings));
+	if(!rings) {
+		perror("calloc");
+		return 1;
+	}
+	perf_open();
+	if(perf_fd < 0)
+		fprintf(stderr, "perf_event_open unavailable, cache misses not reported\n");
+
+	printf("%5s %-6s %-15s %-7s %5s %9s %9s\n", "depth", "op", "sizes", "pattern", "cache", "ns/op", "miss/op");
+	const int nr_rings[] = { 1, COLD_RINGS };
+	for(int r = 0; r < 2; r++) {
+		for(int d = 0; d < DIST_COUNT; d++) {
+			bench_add(rings, nr_rings[r], d, ops);
+			for(int p = 0; p < PAT_COUNT; p++)
+				bench_find(rings, nr_rings[r], d, p, ops);
+		}
+	}
+
+	if(perf_fd >= 0)
+		close(perf_fd);
+	free(rings);
+	return 0;
+}
@@ -0,0 +1,156 @@
+/**
+ * @file lfqueue-bench.c
+ * @brief Throughput of the lfqueue.h queues against a mutex protected list
+ *
+ * One consumer thread drains what 1..N producer threads push, for the SPSC
+ * queue, the MPSC queue and, as the baseline, a pthread mutex around an SLIST
+ * from queue.h (the way aesdsocket hands work between threads today).  Each
+ * case runs with single item and batched operations.
+ *
+ * Prints million items/s per case.
+ *
+ * Usage: lfqueue-bench [items per producer]
+ *
+ * @author Madeleine Monfort
+ * @date 2024-04-27
+ *
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../server/lfqueue.h"
+#include "../server/queue.h"
+
+#define DEFAULT_ITEMS 5000000
+#define MAX_PRODUCERS 4
+#define CAPACITY 4096
+#define BATCH 32
+
+enum kind { KIND_SPSC, KIND_MPSC, KIND_MUTEX, KIND_COUNT };
+static const char* kind_name[KIND_COUNT] = { "spsc", "mpsc", "mutex+slist" };
+
+struct node {
+	SLIST_ENTRY(node) entries;
+};
+
+static struct lfq_spsc spsc;
+static struct lfq_mpsc mpsc;
+static SLIST_HEAD(nodehead, node) list; //static, so starts empty
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct node* nodes; //one per pushed item for the list baseline
+
+static long items_per_producer = DEFAULT_ITEMS;
+static enum kind cur_kind;
+static size_t cur_batch;
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void* producer(void* arg) {
+	long id = (long)arg;
+	void* items[BATCH];
+	long next = 0;
+
+	while(next < items_per_producer) {
+		size_t n = cur_batch;
+		if(n > (size_t)(items_per_producer - next))
+			n = items_per_producer - next;
+		size_t pushed = 0;
+		if(cur_kind == KIND_MUTEX) {
+			pthread_mutex_lock(&list_lock);
+			for(size_t i = 0; i < n; i++)
+				SLIST_INSERT_HEAD(&list, &nodes[id * items_per_producer + next + i], entries);
+			pthread_mutex_unlock(&list_lock);
+			pushed = n;
+		}
+		else {
+			for(size_t i = 0; i < n; i++)
+				items[i] = &nodes[id * items_per_producer + next + i];
+			if(cur_kind == KIND_SPSC)
+				pushed = lfq_spsc_push_batch(&spsc, items, n);
+			else
+				pushed = lfq_mpsc_push_batch(&mpsc, items, n);
+		}
+		if(pushed == 0)
+			sched_yield();
+		next += pushed;
+	}
+	return NULL;
+}
+
+static void consume(long total) {
+	void* items[BATCH];
+
+	while(total > 0) {
+		size_t popped = 0;
+		if(cur_kind == KIND_MUTEX) {
+			pthread_mutex_lock(&list_lock);
+			while(popped < cur_batch && !SLIST_EMPTY(&list)) {
+				SLIST_REMOVE_HEAD(&list, entries);
+				popped++;
+			}
+			pthread_mutex_unlock(&list_lock);
+		}
+		else if(cur_kind == KIND_SPSC)
+			popped = lfq_spsc_pop_batch(&spsc, items, cur_batch);
+		else
+			popped = lfq_mpsc_pop_batch(&mpsc, items, cur_batch);
+		if(popped == 0)
+			sched_yield();
+		total -= popped;
+	}
+}
+
+static void bench(enum kind kind, int producers, size_t batch) {
+	pthread_t threads[MAX_PRODUCERS];
+
+	cur_kind = kind;
+	cur_batch = batch;
+	double start = now_ns();
+	for(long i = 0; i < producers; i++)
+		pthread_create(&threads[i], NULL, producer, (void*)i);
+	consume(items_per_producer * producers);
+	for(int i = 0; i < producers; i++)
+		pthread_join(threads[i], NULL);
+	double ns = now_ns() - start;
+
+	printf("%-12s %9d %5zu %10.2f\n", kind_name[kind], producers, batch,
+		items_per_producer * producers / ns * 1e3);
+}
+
+int main(int argc, char* argv[]) {
+	if(argc > 1)
+		items_per_producer = atol(argv[1]);
+	if(items_per_producer <= 0) {
+		fprintf(stderr, "Usage: %s [items per producer]\n", argv[0]);
+		return 1;
+	}
+	nodes = calloc(items_per_producer * MAX_PRODUCERS, sizeof(*nodes));
+	if(!nodes || lfq_spsc_init(&spsc, CAPACITY) != 0 || lfq_mpsc_init(&mpsc, CAPACITY) != 0) {
+		perror("init");
+		return 1;
+	}
+
+	printf("%-12s %9s %5s %10s\n", "queue", "producers", "batch", "Mitems/s");
+	const size_t batches[] = { 1, BATCH };
+	for(int b = 0; b < 2; b++) {
+		bench(KIND_SPSC, 1, batches[b]);
+		for(int p = 1; p <= MAX_PRODUCERS; p *= 2) {
+			bench(KIND_MPSC, p, batches[b]);
+			bench(KIND_MUTEX, p, batches[b]);
+		}
+	}
+
+	lfq_spsc_destroy(&spsc);
+	lfq_mpsc_destroy(&mpsc);
+	free(nodes);
+	return 0;
+}
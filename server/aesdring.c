@@ -0,0 +1,163 @@
+/* In-process ring for aesdsocket
+ * Author: Madeleine Monfort
+ * Description:
+ *  Stores the received commands in an aesd_circular_buffer inside the server,
+ *  with the same semantics as the aesd char driver, so aesdsocket can run
+ *  without the kernel module.  The ring owns the memory of every entry.
+ *
+ *  The depth is AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, which the Makefile
+ *  sets from RING_DEPTH for this file and aesd-circular-buffer.c only.  The
+ *  ring is never visible outside this file, so the rest of the server keeps
+ *  the driver's value for the ioctl structures.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "../aesd-char-driver/aesd-newline.h"
+#include "aesdring.h"
+
+//in_offs and out_offs are uint8_t
+_Static_assert(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED <= 255, "RING_DEPTH must be at most 255");
+
+#define PARTIAL_MIN_CAP 64 //first allocation of a partial command, doubled as it grows
+
+static struct aesd_circular_buffer ring;
+static char* partial = NULL; //command still waiting for its '\n'
+static size_t partial_len = 0;
+static size_t partial_cap = 0; //bytes allocated for partial
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int ring_init(void) {
+	aesd_circular_buffer_init(&ring);
+	partial = NULL;
+	partial_len = partial_cap = 0;
+	return 0;
+}
+
+void ring_destroy(void) {
+	uint8_t index;
+	struct aesd_buffer_entry* entry;
+
+	pthread_mutex_lock(&ring_lock);
+	AESD_CIRCULAR_BUFFER_FOREACH(entry, &ring, index) {
+		free((char*)entry->buffptr);
+	}
+	aesd_circular_buffer_init(&ring);
+	free(partial);
+	partial = NULL;
+	partial_len = partial_cap = 0;
+	pthread_mutex_unlock(&ring_lock);
+}
+
+/* RING_COMMIT
+ * Description: stores the completed partial command in the ring,
+ *  freeing the command it overwrites.  Caller must hold ring_lock.
+ */
+static void ring_commit(void) {
+	struct aesd_buffer_entry entry;
+
+	if(ring.full)
+		free((char*)ring.entry[ring.in_offs].buffptr);
+	entry.buffptr = partial;
+	entry.size = partial_len;
+	entry.priv = NULL;
+	aesd_circular_buffer_add_entry(&ring, &entry);
+	partial = NULL;
+	partial_len = partial_cap = 0;
+}
+
+/* PARTIAL_RESERVE
+ * Description: makes room for want bytes in the partial command, doubling its
+ *  capacity so a command received in many small pieces is copied O(log n) times.
+ *  Caller must hold ring_lock.
+ * Output: 0 if successful, -1 if out of memory
+ */
+static int partial_reserve(size_t want) {
+	size_t cap = partial_cap ? partial_cap : PARTIAL_MIN_CAP;
+
+	if(want <= partial_cap)
+		return 0;
+	while(cap < want)
+		cap *= 2;
+	char* tmp = realloc(partial, cap);
+	if(!tmp)
+		return -1;
+	partial = tmp;
+	partial_cap = cap;
+	return 0;
+}
+
+int ring_append(const char* data, size_t len) {
+	int result = 0;
+
+	pthread_mutex_lock(&ring_lock);
+	while(len > 0) {
+		//take bytes up to and including the next '\n'
+		const char* nl = aesd_find_newline(data, len);
+		size_t chunk = nl ? (size_t)(nl - data) + 1 : len;
+
+		if(partial_reserve(partial_len + chunk) != 0) {
+			errno = ENOMEM;
+			result = -1;
+			break;
+		}
+		memcpy(partial + partial_len, data, chunk);
+		partial_len += chunk;
+		data += chunk;
+		len -= chunk;
+
+		if(nl)
+			ring_commit();
+	}
+	pthread_mutex_unlock(&ring_lock);
+	return result;
+}
+
+ssize_t ring_read(off_t* pos, char* buf, size_t len) {
+	size_t entry_pos = 0;
+	ssize_t num_read = 0;
+
+	pthread_mutex_lock(&ring_lock);
+	struct aesd_buffer_entry* entry = aesd_circular_buffer_find_entry_offset_for_fpos(&ring, *pos, &entry_pos);
+	if(entry) {
+		num_read = entry->size - entry_pos;
+		if((size_t)num_read > len)
+			num_read = len;
+		memcpy(buf, entry->buffptr + entry_pos, num_read);
+		*pos += num_read;
+	}
+	pthread_mutex_unlock(&ring_lock);
+	return num_read;
+}
+
+int ring_seekto(uint32_t cmd, uint32_t offset, off_t* pos) {
+	int result = 0;
+
+	pthread_mutex_lock(&ring_lock);
+	uint32_t count = ring.full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED :
+		(ring.in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - ring.out_offs) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	if(cmd >= count) {
+		result = -1;
+	}
+	else {
+		//sum the sizes of the commands before cmd
+		off_t new_pos = 0;
+		uint8_t i = ring.out_offs;
+		for(uint32_t n = 0; n < cmd; n++) {
+			new_pos += ring.entry[i].size;
+			i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+		}
+		if(offset > ring.entry[i].size)
+			result = -1;
+		else
+			*pos = new_pos + offset;
+	}
+	pthread_mutex_unlock(&ring_lock);
+
+	if(result == -1)
+		errno = EINVAL;
+	return result;
+}
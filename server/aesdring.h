@@ -0,0 +1,61 @@
+/*
+ * aesdring.h
+ *
+ *  Created on: Apr 24, 2024
+ *      Author: Madeleine Monfort
+ *
+ *  @brief In-process log store for aesdsocket, built on the aesd circular buffer
+ */
+
+#ifndef AESDRING_H_
+#define AESDRING_H_
+//-------------------------INCLUDES-------------------------
+#include <stdint.h>
+#include <sys/types.h>
+
+//-------------------------FUNCTIONS-------------------------
+/* RING_INIT
+ * Description: empties the ring, call once before any other ring function
+ * Output: 0 if successful, -1 upon failure
+ */
+int ring_init(void);
+
+/* RING_DESTROY
+ * Description: frees every stored command and the partial command
+ */
+void ring_destroy(void);
+
+/* RING_APPEND
+ * Description: appends data the same way a write to the aesd char driver does.
+ *  Every '\n' completes a command, which is stored in the ring and evicts the
+ *  oldest command when the ring is full.  Bytes after the last '\n' are kept
+ *  until a later append completes them.
+ * Input:
+ *  data = bytes to append
+ *  len = number of bytes
+ * Output: 0 if successful, -1 upon failure (errno is set)
+ * Safety: thread safe
+ */
+int ring_append(const char* data, size_t len);
+
+/* RING_READ
+ * Description: copies stored bytes starting at *pos, never past the end of
+ *  the command holding *pos, and advances *pos past them
+ * Input:
+ *  pos = read position of the caller, as a file offset on the char device
+ *  buf = destination
+ *  len = size of buf
+ * Output: number of bytes copied, 0 at the end of the data
+ * Safety: thread safe
+ */
+ssize_t ring_read(off_t* pos, char* buf, size_t len);
+
+/* RING_SEEKTO
+ * Description: moves *pos to byte offset of command cmd, counted from the
+ *  oldest stored command, like AESDCHAR_IOCSEEKTO on the char device
+ * Output: 0 if successful, -1 with errno EINVAL if cmd or offset is out of range
+ * Safety: thread safe
+ */
+int ring_seekto(uint32_t cmd, uint32_t offset, off_t* pos);
+
+#endif /* AESDRING_H_ */
@@ -16,9 +16,20 @@
  *    This program will utilize the aesd-char-driver's llseek and ioctl
  *    and therefore swaps out pread for read.  
  *
+ *  With the ring backend, the commands are kept in an in-process
+ *  aesd circular buffer (aesdring.c) with the same semantics as the driver,
+ *  so no kernel module is needed.
+ *
+ *  Settings come from a config file and the command line (config.h), with
+ *  the defines in aesdsocket.h as defaults; SIGHUP reloads the live ones.
+ *
  * Exit:
  *  This application will exit upon reciept of a signal or failure to connect.  
- *  It will specifically handle SIGINT and SIGTERM gracefully.
+ *  It will specifically handle SIGINT and SIGTERM gracefully: it stops
+ *  accepting, lets every connection finish the commands it has received for
+ *  up to drain_timeout_ms, then syncs the driver before exiting.
+ *  Connections still running then are cut off, and any thread that doesn't
+ *  end within DRAIN_FORCE_MS after that is abandoned to the exit.
  *
  * Return value:
  *  0 upon successful termination.  -1 upon socket connection failure.
@@ -26,6 +37,17 @@
 
 #include "aesdsocket.h"
 
+//read position of the connection served by this thread, in ring mode
+static __thread off_t ring_pos = 0;
+
+//-c config file made absolute at startup, a reload happens after the daemon's chdir("/")
+static char config_path[PATH_MAX];
+
+//CPUs the process may run on before the acceptor was pinned
+static cpu_set_t default_cpus;
+//CPUs for connection threads, worker_node's or default_cpus
+static cpu_set_t worker_cpus;
+
 //function: signal handler
 // to handle the SIGINT and SIGTERM signals
 // force exit from main while loop
@@ -37,6 +59,12 @@ static void signal_handler( int sn ) {
 	}
 }
 
+static void hup_handler( int sn ) {
+	if(sn == SIGHUP) {
+		caught_hup = 1;
+	}
+}
+
 static void timer_handler( int sn ) {
 	if(sn == SIGALRM) {
 		caught_timer = 1;
@@ -48,14 +76,15 @@ static void timer_handler( int sn ) {
  *   If the data buffer is in fact an ioctl command.
  * Inputs:
  *   fd = file descriptor for the device driver
- *   data = data buffer holding the ioctl command
- *   len = size of data buffer
+ *   data = one command, possibly an ioctl command
+ *   len = size of the command
  * Outputs:
  *   result = 0 if successful ioctl command run,
  *	     -1 upon failure or an invalid command for ioctl
  */
 int do_ioctl(int fd, char* data, ssize_t len) {
 	int result = 0;
+	char line[IOCTL_MAX_L + 1];
 	
 	//CHECK that it is a valid IOCTL command
 	if(!data) {
@@ -71,10 +100,18 @@ int do_ioctl(int fd, char* data, ssize_t len) {
 		syslog(LOG_DEBUG, "Not IOCTL.");
 		return -1;
 	}
+	if(len > IOCTL_MAX_L) {
+		syslog(LOG_ERR, "ERROR: IOCTL not formatted correctly.");
+		return -1;
+	}
+	
+	//data isn't terminated and more commands may follow it, parse a copy
+	memcpy(line, data, len);
+	line[len] = '\0';
 	
 	//setup cmd and offset
 	const char delimiters[] = ":,";
-	char* token = strtok(data, delimiters);
+	char* token = strtok(line, delimiters);
 	if(!token) {
 		syslog(LOG_ERR, "ERROR: IOCTL not formatted correctly.");
 		return -1;
@@ -100,7 +137,10 @@ int do_ioctl(int fd, char* data, ssize_t len) {
 	seekto.write_cmd_offset = offset;
 	
 	//call ioctl
-	result = ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto);
+	if(cfg.backend == BACKEND_RING)
+		result = ring_seekto(seekto.write_cmd, seekto.write_cmd_offset, &ring_pos);
+	else
+		result = ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto);
 	
 	return result;
 }
@@ -119,11 +159,19 @@ int do_ioctl(int fd, char* data, ssize_t len) {
 int file_write(int fd, char* data, ssize_t len, pthread_mutex_t* m) {
 	int result;
 	
-	if(USE_AESD_CHAR_DEVICE) { //check ioctl
+	if(cfg.backend != BACKEND_FILE) { //check ioctl
 		int rc = do_ioctl(fd, data, len);
 		if(rc == 0) return 0;
 	}
 	
+	//the ring does its own locking
+	if(cfg.backend == BACKEND_RING) {
+		result = ring_append(data, len);
+		if(result != 0)
+			syslog(LOG_ERR, "Failed to append to the ring:%m\n");
+		return result;
+	}
+	
 	//try to lock
 	result = pthread_mutex_lock(m);
 	if(result != 0) { //failure
@@ -153,6 +201,67 @@ int file_write(int fd, char* data, ssize_t len, pthread_mutex_t* m) {
 	return result;
 }
 
+/*SPLICE_LINE
+ * Description: sends the rest of the device to the socket through a pipe
+ *  with splice, so the data is moved by the kernel without a copy to user space
+ * Input:
+ *  socket = the socket to echo the file to
+ *  fd = file descriptor
+ * Output:
+ *  -1 if error, 0 if successful, -2 if fd can't be spliced and nothing was sent
+ */
+static int splice_line(int socket, int fd) {
+	int pfd[2];
+	ssize_t total = 0;
+	int result = 0;
+	
+	if(pipe(pfd) == -1) {
+		syslog(LOG_ERR, "Failed to create splice pipe:%m\n");
+		return -2;
+	}
+	
+	while(1) {
+		//device -> pipe, the pipe gets references to the driver's pages
+		ssize_t num_in = splice(fd, NULL, pfd[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE);
+		if(num_in == -1) {
+			if(total == 0 && errno == EINVAL) { //driver without splice support
+				result = -2;
+			}
+			else {
+				syslog(LOG_ERR, "Failed to splice from file:%m\n");
+				result = -1;
+			}
+			break;
+		}
+		if(num_in == 0) //end of file reached
+			break;
+		
+		//pipe -> socket
+		while(num_in > 0) {
+			ssize_t num_out = splice(pfd[0], NULL, socket, NULL, num_in, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if(num_out == -1) {
+				syslog(LOG_ERR, "Failed to splice to socket:%m\n");
+				result = -1;
+				break;
+			}
+			num_in -= num_out;
+			total += num_out;
+		}
+		if(result == -1)
+			break;
+	}
+	
+	//commands in the driver always end in a newline, only an empty device needs one
+	if(result == 0 && total == 0) {
+		int rc = send(socket, "\n", 1, 0);
+		if(rc == -1) syslog(LOG_ERR, "failed to send:%m\n");
+	}
+	
+	close(pfd[0]);
+	close(pfd[1]);
+	return result;
+}
+
 /*SEND_LINE
  * Description: sends a portion of the file at a time (defined by MAX_BUF_SIZE)
  * Input: 
@@ -162,19 +271,39 @@ int file_write(int fd, char* data, ssize_t len, pthread_mutex_t* m) {
  *  -1 if error, 0 if successful
  */
 int send_line(int socket, int fd) {
-	char read_buf[MAX_BUF_SIZE];
+	char stack_buf[MAX_BUF_SIZE];
+	char* read_buf = stack_buf;
+	size_t buf_len = MAX_BUF_SIZE;
 	off_t cur_off = 0;
 	
 	int result;
 	char last_byte = 0;
 	
+	//kernel-only transfer when the driver supports splice
+	if(cfg.backend == BACKEND_CHAR) {
+		result = splice_line(socket, fd);
+		if(result != -2)
+			return result;
+	}
+	
+	//a pool buffer moves the file in far fewer reads and sends
+	if(cfg.buf_pool) {
+		char* pool_buf = bufpool_get();
+		if(pool_buf) {
+			read_buf = pool_buf;
+			buf_len = bufpool_buf_size();
+		}
+	}
+	
 	while(1) {
 		//read from socket the max allowed at a time
 		ssize_t num_read = 0;
-		if(USE_AESD_CHAR_DEVICE)
-			num_read = read(fd, read_buf, MAX_BUF_SIZE);
+		if(cfg.backend == BACKEND_RING)
+			num_read = ring_read(&ring_pos, read_buf, buf_len);
+		else if(cfg.backend == BACKEND_CHAR)
+			num_read = read(fd, read_buf, buf_len);
 		else
-			num_read = pread(fd, read_buf, MAX_BUF_SIZE, cur_off);
+			num_read = pread(fd, read_buf, buf_len, cur_off);
 		if(num_read == -1) {
 			syslog(LOG_ERR, "Buffered file read:%m\n");
 			result = -1;
@@ -203,84 +332,199 @@ int send_line(int socket, int fd) {
 	
 	}//end while
 	
+	if(read_buf != stack_buf)
+		bufpool_put(read_buf);
+	return result;
+}
+
+/* IS_IOCTL
+ * Output: 1 if the command of len bytes at data should go to do_ioctl
+ */
+static int is_ioctl(const char* data, size_t len) {
+	return cfg.backend != BACKEND_FILE &&
+		len >= IOCTL_CMD_L && strncmp(data, IOCTL_CMD, IOCTL_CMD_L) == 0;
+}
+
+/* WRITE_COMMANDS
+ * Description: writes out buffered commands, starting with the one ending at nl.
+ *  With echo_per_command only that one, otherwise every complete command in rx.
+ *  Consecutive plain commands go out in a single write, ioctl commands on
+ *  their own so they run in order with the data around them.
+ * Inputs:
+ *  fd = file descriptor of specified file
+ *  m = mutex to control file access
+ *  rx = receive buffer, its start moves past the written commands
+ *  nl = the newline ending the first buffered command
+ * Output:
+ *  result = -1 upon failure, 1 if successful
+ */
+static int write_commands(int fd, pthread_mutex_t* m, struct rx_buffer* rx, const char* nl) {
+	int result = 1;
+	char* run = rx->data + rx->start; //plain commands not written yet
+	char* cmd = run;
+	const char* end = rx->data + rx->len;
+	
+	while(nl) {
+		char* next = (char*)nl + 1;
+		if(is_ioctl(cmd, next - cmd)) {
+			if(cmd > run && file_write(fd, run, cmd - run, m) != 0)
+				result = -1;
+			if(file_write(fd, cmd, next - cmd, m) != 0)
+				result = -1;
+			run = next;
+		}
+		cmd = next;
+		if(rx->echo_per_command)
+			break;
+		nl = aesd_find_newline(cmd, end - cmd);
+	}
+	if(cmd > run && file_write(fd, run, cmd - run, m) != 0)
+		result = -1;
+	
+	rx->start = cmd - rx->data;
+	if(result == -1)
+		syslog(LOG_ERR, "Failed to write to the file\n");
 	return result;
 }
 
+/* RX_GROW
+ * Description: makes room for at least want more bytes in rx.
+ *  The first buffer comes from the pool when it's enabled; a command that
+ *  outgrows it moves to the heap.
+ * Output: 0 if successful, -1 upon failure
+ */
+static int rx_grow(struct rx_buffer* rx, size_t want) {
+	if(!rx->data && cfg.buf_pool && bufpool_buf_size() >= want) {
+		rx->data = bufpool_get();
+		if(rx->data) {
+			rx->cap = bufpool_buf_size();
+			return 0;
+		}
+	}
+	
+	size_t new_cap = rx->cap ? rx->cap * 2 : want;
+	while(new_cap - rx->len < want)
+		new_cap *= 2;
+	char* tmp;
+	if(bufpool_owns(rx->data)) {
+		tmp = malloc(new_cap);
+		if(tmp) {
+			memcpy(tmp, rx->data, rx->len);
+			bufpool_put(rx->data);
+		}
+	}
+	else {
+		tmp = realloc(rx->data, new_cap);
+	}
+	if(!tmp) {
+		syslog(LOG_ERR, "Failed to realloc receive buffer: %m\n");
+		return -1;
+	}
+	rx->data = tmp;
+	rx->cap = new_cap;
+	return 0;
+}
+
 /*READ_PACKET 
- * Description: buffered reads the packet of data
- *  assumes the end of a packet is from null terminator
- *  writes the data out to specified file
+ * Description: buffered reads commands from the socket
+ *  a command ends at a '\n'.  One recv may hold several commands or part of
+ *  one.  Every complete command received so far is written out as one batch
+ *  (or just the first one with echo_per_command), the rest is kept in rx for
+ *  the next call.
  * Inputs: 
  *  socket = socket file descriptor to read data from
  *  fd = file descriptor of specified file
  *  m = mutex to control file access
+ *  rx = bytes received on this socket and not written yet
  * Output:
  *  result = -1 upon failure, 0 if connection closed, 1 if successful
  */
-int read_packet(int socket, int fd, pthread_mutex_t* m) {
+int read_packet(int socket, int fd, pthread_mutex_t* m, struct rx_buffer* rx) {
 	int result;
-	char read_buf[MAX_BUF_SIZE];
-	
-	char* buffer = malloc(1);
-	if(!buffer) {
-		syslog(LOG_ERR, "Failed to malloc: %m\n");
-		result = -1;
-	}
-	*buffer = '\0'; //initialize to null pointer terminated string
-	ssize_t bufs = 0;
+	size_t scanned = rx->start; //bytes before this hold no newline
+	size_t want = rx->want;
 	
 	while(1) {
-		memset(read_buf, 0, MAX_BUF_SIZE); //default to 0s
-		//read from socket the max allowed at a time
-		ssize_t num_read = recv(socket, read_buf, MAX_BUF_SIZE-1, 0);
+		const char* nl = aesd_find_newline(rx->data + scanned, rx->len - scanned);
+		if(nl) //at least one full command is buffered
+			return write_commands(fd, m, rx, nl);
+		scanned = rx->len;
+		
+		//make room for a recv: drop written bytes first, then grow
+		if(rx->cap - rx->len < want) {
+			if(rx->start > 0) {
+				memmove(rx->data, rx->data + rx->start, rx->len - rx->start);
+				rx->len -= rx->start;
+				scanned -= rx->start;
+				rx->start = 0;
+			}
+			if(rx->cap - rx->len < want && rx_grow(rx, want) != 0)
+				return -1;
+		}
+		
+		//read from socket as much as fits
+		ssize_t num_read = recv(socket, rx->data + rx->len, rx->cap - rx->len, 0);
 		if(num_read == -1) {
 			syslog(LOG_ERR, "Failed to recv: %m\n");
-			result = -1;
-			break;
+			return -1;
 		}
-		else  if(num_read == 0) { //connection closed
+		if(num_read == 0) { //connection closed, keep the unterminated tail
 			result = 0;
-			break;
-		}
-		else {
-			//reallocate buffer with string lengths of char arrays + \0
-			size_t new_len = strlen(read_buf) + strlen(buffer) + 1;
-			char* tmp = realloc(buffer, new_len);
-			if(!tmp) {
-				syslog(LOG_ERR, "Failed to realloc write buffer: %m\n");
+			if(rx->len > rx->start && file_write(fd, rx->data + rx->start, rx->len - rx->start, m) != 0) {
+				syslog(LOG_ERR, "Failed to write to the file\n");
 				result = -1;
-				break;
 			}
-			//mem handling
-			buffer = tmp;
-			
-			//increase total size of packet
-			bufs += num_read;
-			
-			//concatenate contents into buffer
-			strcat(buffer, read_buf);
-			
-			//break out if read the end of packet
-			int eop = num_read -1;
-			if(read_buf[eop] == '\n') {
-				result = 1;
-				break;
-			}
-		} //end if-else
-	
+			rx->start = rx->len;
+			return result;
+		}
+		rx->len += num_read;
 	}//end while
+}
+
+/* INIT_PLACEMENT
+ * Description: works out the worker CPUs and pins the calling (accepting) thread
+ *  failures are logged and leave the thread where the scheduler puts it
+ */
+static void init_placement(void) {
+	if(sched_getaffinity(0, sizeof(default_cpus), &default_cpus) != 0) {
+		syslog(LOG_ERR, "Failed to get the CPU affinity:%m\n");
+		CPU_ZERO(&default_cpus);
+		for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &default_cpus);
+	}
+	worker_cpus = default_cpus;
+	if(cfg.worker_node >= 0 && affinity_node_cpus(cfg.worker_node, &worker_cpus) != 0) {
+		syslog(LOG_ERR, "Can't place workers on node %d, using all CPUs\n", cfg.worker_node);
+		worker_cpus = default_cpus;
+	}
 	
-	//only write packet upon successful read
-	if(result == 1 || result == 0) {
-		//write buffer to file
-		int num_w = file_write(fd, buffer, bufs, m);
-		if(num_w != 0) {
-			syslog(LOG_ERR, "Failed to write to the file\n");
-			result = -1;
+	if(cfg.accept_cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cfg.accept_cpu, &set);
+		if(sched_setaffinity(0, sizeof(set), &set) != 0)
+			syslog(LOG_ERR, "Failed to pin the acceptor to CPU %d:%m\n", cfg.accept_cpu);
+	}
+}
+
+/* WORKER_PLACEMENT
+ * Description: picks the CPUs of the thread serving a new connection.  With
+ *  worker_follow_rx_cpu that is the CPU that received its packets, so the
+ *  socket buffers are still in that core's cache, as long as the CPU is one
+ *  of worker_cpus.
+ * Input:
+ *  nsfd = accepted socket
+ *  set = filled in with the CPUs
+ */
+static void worker_placement(int nsfd, cpu_set_t* set) {
+	*set = worker_cpus;
+	if(cfg.worker_follow_rx_cpu) {
+		int cpu = affinity_incoming_cpu(nsfd);
+		if(cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &worker_cpus)) {
+			CPU_ZERO(set);
+			CPU_SET(cpu, set);
 		}
 	}
-	free(buffer);
-	return result;
 }
 
 /* ACCEPT_SOCKET
@@ -329,7 +573,7 @@ int init_socket() {
 	hint.ai_flags = AI_PASSIVE; //to make the address suitable for bind/accept
 	
 	struct addrinfo* addr_sp;
-	int rc = getaddrinfo(NULL, S_PORT, &hint, &addr_sp);
+	int rc = getaddrinfo(NULL, cfg.port, &hint, &addr_sp);
 	if(rc != 0) {
 		close(sfd);
 		syslog(LOG_ERR, "getaddr fail:%s\n", gai_strerror(rc));
@@ -351,7 +595,7 @@ int init_socket() {
 	}
 	
 	//listen to socket
-	int result = listen(sfd, BACKLOG); 
+	int result = listen(sfd, cfg.backlog); 
 	if(result == -1) {
 		syslog(LOG_ERR, "Failed to listen.%m\n");
 		close(sfd);	
@@ -360,6 +604,108 @@ int init_socket() {
 	return sfd;
 }
 
+/* SET_DEFAULTS
+ * Description: fills c with the compile time defaults from aesdsocket.h
+ */
+static void set_defaults(struct aesd_config* c) {
+	memset(c, 0, sizeof(*c));
+	snprintf(c->port, sizeof(c->port), "%s", S_PORT);
+	c->backlog = BACKLOG;
+	c->backend = USE_AESD_RING ? BACKEND_RING : BACKEND_CHAR;
+	c->buf_pool = USE_BUF_POOL;
+	c->pool_buf_size = BUF_POOL_BUF_SIZE;
+	c->pool_count = BUF_POOL_COUNT;
+	c->pool_mlock = BUF_POOL_MLOCK;
+	c->accept_cpu = ACCEPT_CPU;
+	c->worker_node = WORKER_NODE;
+	c->rx_buf_size = RX_BUF_SIZE;
+	c->echo_per_command = ECHO_PER_COMMAND;
+	c->worker_follow_rx_cpu = WORKER_FOLLOW_RX_CPU;
+	c->drain_timeout_ms = DRAIN_TIMEOUT_MS;
+	c->timestamp_interval = TIMESTAMP_INTERVAL;
+	snprintf(c->timestamp_format, sizeof(c->timestamp_format), "%s", RFC2822_FORMAT);
+}
+
+/* LOAD_CONFIG
+ * Description: fills c with the defaults, then the config file, then the command line
+ * Input:
+ *  c = settings to fill in
+ *  daemon = set to 1 with -d
+ * Output: 0 if successful, -1 upon a bad setting, 1 if only the usage was asked for
+ */
+static int load_config(struct aesd_config* c, int argc, char* argv[], int* daemon) {
+	const char* file = NULL;
+	
+	//the command line names the file but wins over it, so look for -c first
+	set_defaults(c);
+	int rc = config_parse_args(c, argc, argv, &file, daemon);
+	if(rc != 0)
+		return rc;
+	
+	//argv doesn't change, so the path resolved at startup holds for every reload
+	if(file && config_path[0] == '\0' && !realpath(file, config_path)) {
+		syslog(LOG_ERR, "Failed to find config %s:%m\n", file);
+		return -1;
+	}
+	
+	set_defaults(c);
+	if(file || access(CONFIG_DEFAULT_FILE, F_OK) == 0) {
+		if(config_load_file(c, file ? config_path : CONFIG_DEFAULT_FILE) != 0)
+			return -1;
+	}
+	rc = config_parse_args(c, argc, argv, &file, daemon);
+	if(rc != 0)
+		return rc;
+	
+	if(c->path[0] == '\0')
+		snprintf(c->path, sizeof(c->path), "%s", c->backend == BACKEND_CHAR ? DEVICE_FILENAME : DATA_FILENAME);
+	return 0;
+}
+
+/* ARM_TIMER
+ * Description: starts the timestamp timer of the file backend, or stops it
+ *  when timestamp_interval is 0
+ */
+static void arm_timer(void) {
+	struct itimerval delay;
+	delay.it_value.tv_sec = cfg.timestamp_interval;
+	delay.it_value.tv_usec = 0;
+	delay.it_interval.tv_sec = cfg.timestamp_interval;
+	delay.it_interval.tv_usec = 0;
+	setitimer(ITIMER_REAL, &delay, NULL);
+}
+
+/* DEADLINE_AFTER
+ * Description: sets ts to ms milliseconds from now, on the clock pthread_timedjoin_np uses
+ */
+static void deadline_after(struct timespec* ts, int ms) {
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if(ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* RELOAD_CONFIG
+ * Description: reads the config file and command line again and applies
+ *  the live settings, keeping everything as is when they don't parse
+ */
+static void reload_config(int argc, char* argv[]) {
+	struct aesd_config fresh;
+	int daemon = 0;
+	
+	if(load_config(&fresh, argc, argv, &daemon) != 0) {
+		syslog(LOG_ERR, "Reload failed, keeping the current settings\n");
+		return;
+	}
+	int old_interval = cfg.timestamp_interval;
+	config_apply_live(&fresh);
+	if(cfg.backend == BACKEND_FILE && cfg.timestamp_interval != old_interval)
+		arm_timer();
+}
+
 void* threadfunc(void* thread_param)
 {
 	//setup threading info
@@ -369,11 +715,14 @@ void* threadfunc(void* thread_param)
 	}
 	struct thread_data* tdp = (struct thread_data *) thread_param;
 	int success = 1;
+	
+	//a new connection reads from the start, like a new open of the driver
+	ring_pos = 0;
     
 	//continuously read on a socket
 	while(1) {
 		//read full packet
-		int rc = read_packet(tdp->nsfd, tdp->fd, tdp->m);
+		int rc = read_packet(tdp->nsfd, tdp->fd, tdp->m, &tdp->rx);
 		if(rc == -1) { //reading/echoing failed in some way
 			syslog(LOG_ERR, "Not reading correctly.\n");
 			success = -1;
@@ -385,10 +734,20 @@ void* threadfunc(void* thread_param)
 		
 		syslog(LOG_DEBUG,"Read packet.\n");
 		//attempt to echo the file back
-		send_line(tdp->nsfd, tdp->fd);
+		if(send_line(tdp->nsfd, tdp->fd) == -1) {
+			//peer gone or cut off by the drain, nobody is left to answer
+			syslog(LOG_DEBUG, "Echo failed, closing connection.\n");
+			break;
+		}
 		syslog(LOG_DEBUG,"sent back file.\n");
 		
 	} //end of reading packets
+	if(bufpool_owns(tdp->rx.data))
+		bufpool_put(tdp->rx.data);
+	else
+		free(tdp->rx.data);
+	tdp->rx.data = NULL;
+	bufpool_thread_exit();
     
 	tdp->complete_flag = success;
     
@@ -398,19 +757,47 @@ void* threadfunc(void* thread_param)
 int main(int argc, char* argv[]) {
 	int result = 0;
 	int fd;
+	int daemon = 0;
 	
 	//setup syslog
 	openlog("assignment_8", 0, LOG_USER);
 	
-	//open stream bound to port 9000, returns -1 upon failure to connect
+	//settings first, everything below depends on them
+	int rc = load_config(&cfg, argc, argv, &daemon);
+	if(rc == 1) { //only usage asked for
+		closelog();
+		return 0;
+	}
+	if(rc != 0) {
+		syslog(LOG_ERR, "ERROR: bad settings.\n");
+		closelog();
+		return -1;
+	}
+	
+	//open stream bound to the configured port, returns -1 upon failure to connect
 	sfd = init_socket();
 	if(sfd == -1){	
 		result = -1;
 	}
 	
+	//the ring lives as long as the server
+	if(cfg.backend == BACKEND_RING) {
+		fd = -1;
+		if(ring_init() != 0) {
+			syslog(LOG_ERR, "ERROR creating the ring\n");
+			result = -1;
+		}
+	}
+	
+	//a failed pool isn't fatal, buffers then come from the stack and heap
+	if(cfg.buf_pool) {
+		if(bufpool_init(cfg.pool_buf_size, cfg.pool_count, cfg.pool_mlock ? BUFPOOL_MLOCK : 0) != 0)
+			syslog(LOG_ERR, "ERROR creating the buffer pool, continuing without it\n");
+	}
+	
 	//make/open the file for appending and read/write
-	if(!USE_AESD_CHAR_DEVICE) {
-		fd = open(FILENAME, O_CREAT | O_RDWR | O_APPEND, 00666);
+	if(cfg.backend == BACKEND_FILE) {
+		fd = open(cfg.path, O_CREAT | O_RDWR | O_APPEND, 00666);
 		if(fd == -1) {
 			syslog(LOG_ERR, "ERROR opening file:%m\n");
 			result = -1;
@@ -421,7 +808,7 @@ int main(int argc, char* argv[]) {
 	struct sigaction new_act;
 	memset(&new_act, 0, sizeof(struct sigaction)); //default the sigaction struct
 	new_act.sa_handler = signal_handler; //setup the signal handling function
-	int rc = sigaction(SIGTERM, &new_act, NULL); //register for SIGTERM
+	rc = sigaction(SIGTERM, &new_act, NULL); //register for SIGTERM
 	if(rc != 0) {
 		syslog(LOG_ERR, "Error %d registering for SIGTERM\n", errno);
 		result = -1;
@@ -431,8 +818,22 @@ int main(int argc, char* argv[]) {
 		syslog(LOG_ERR, "Error %d registering for SIGINT\n", errno);
 		result = -1;
 	}
+	//a send on a connection cut off by the drain must fail, not kill us
+	new_act.sa_handler = SIG_IGN;
+	rc = sigaction(SIGPIPE, &new_act, NULL);
+	if(rc != 0) {
+		syslog(LOG_ERR, "Error %d ignoring SIGPIPE\n", errno);
+		result = -1;
+	}
 	
-	if(!USE_AESD_CHAR_DEVICE) {
+	new_act.sa_handler = hup_handler;
+	rc = sigaction(SIGHUP, &new_act, NULL); //register for SIGHUP, reloads the settings
+	if(rc != 0) {
+		syslog(LOG_ERR, "Error %d registering for SIGHUP\n", errno);
+		result = -1;
+	}
+	
+	if(cfg.backend == BACKEND_FILE) {
 		new_act.sa_handler = timer_handler; //setup the signal handling function
 		rc = sigaction(SIGALRM, &new_act, NULL); //register for SIGALRM
 		if(rc != 0) {
@@ -443,15 +844,7 @@ int main(int argc, char* argv[]) {
 	
 	
 	//support -d argument for creating daemon
-	if(argc == 2) {
-		//compare argv[1] with "-d"
-		int res = strcmp(argv[1], "-d");
-		if(res != 0) {
-			syslog(LOG_ERR, "ERROR: incorrect arguments.\n");
-			syslog(LOG_ERR, "Usage: ./aesdsocket or ./aesdsocket -d\n");
-			result = -1;
-		}
-		
+	if(daemon) {
 		//fork to create daemon here-- (socket bound, signal actions will carry over)
 		pid_t cpid = fork();
 		if(cpid == -1){ //this is failure condition of fork
@@ -473,6 +866,9 @@ int main(int argc, char* argv[]) {
 		freopen("/dev/null", "w", stderr);
 	}
 	
+	//pin before any connection thread exists, they get their own placement
+	init_placement();
+	
 	//continually accept!
 
 	//create linked list
@@ -483,17 +879,21 @@ int main(int argc, char* argv[]) {
 	pthread_mutex_t mutex;
 	pthread_mutex_init(&mutex, NULL);
 	
-	//setup 10 second timer
-	struct itimerval delay;
+	//the handlers only set flags for this loop, keep the signals out of the
+	//connection threads so they can't interrupt a recv() or splice() there
+	sigset_t worker_block, saved_mask;
+	sigemptyset(&worker_block);
+	sigaddset(&worker_block, SIGHUP);
+	sigaddset(&worker_block, SIGINT);
+	sigaddset(&worker_block, SIGTERM);
+	sigaddset(&worker_block, SIGALRM);
+	
+	//setup the timestamp timer
 	char data[MAX_TIME_SIZE];
 	time_t rawNow;
 	struct tm* now = (struct tm*)malloc(sizeof(struct tm));
-	if(!USE_AESD_CHAR_DEVICE) {
-		delay.it_value.tv_sec = 10;
-		delay.it_value.tv_usec = 0;
-		delay.it_interval.tv_sec = 10;
-		delay.it_interval.tv_usec = 0;
-		setitimer(ITIMER_REAL, &delay, NULL);
+	if(cfg.backend == BACKEND_FILE) {
+		arm_timer();
 		memset(&data, 0, MAX_TIME_SIZE);
 	}
 	
@@ -505,8 +905,8 @@ int main(int argc, char* argv[]) {
 			//----create a new thread----
 			pthread_t thread;
 			
-			if(USE_AESD_CHAR_DEVICE) {
-				fd = open(FILENAME, O_RDWR);
+			if(cfg.backend == BACKEND_CHAR) {
+				fd = open(cfg.path, O_RDWR);
 				if(fd == -1) {
 					syslog(LOG_ERR, "ERROR opening file:%m\n");
 					result = -1;
@@ -525,6 +925,9 @@ int main(int argc, char* argv[]) {
 			td->nsfd = nsfd;
 			td->fd = fd;
 			td->complete_flag = 0;
+			memset(&td->rx, 0, sizeof(td->rx));
+			td->rx.want = cfg.rx_buf_size;
+			td->rx.echo_per_command = cfg.echo_per_command;
 			memcpy(td->host, host, NI_MAXHOST);
 			
 			//setup linked list element
@@ -536,7 +939,19 @@ int main(int argc, char* argv[]) {
 				continue;
 			}
 
-			int rc = pthread_create(&thread, NULL, &threadfunc, td);
+			//threads would otherwise inherit the acceptor's CPU
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			if(cfg.accept_cpu >= 0 || cfg.worker_node >= 0 || cfg.worker_follow_rx_cpu) {
+				cpu_set_t set;
+				worker_placement(nsfd, &set);
+				pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+			}
+			//a new thread inherits the mask of the thread creating it
+			pthread_sigmask(SIG_BLOCK, &worker_block, &saved_mask);
+			int rc = pthread_create(&thread, &attr, &threadfunc, td);
+			pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+			pthread_attr_destroy(&attr);
 			if(rc != 0) {
 				syslog(LOG_ERR, "Failed to create thread.\n");
 				free(td);
@@ -560,7 +975,10 @@ int main(int argc, char* argv[]) {
 			
 			//format timestamp
 			memset(&data, 0, MAX_TIME_SIZE);
-			strftime(data, MAX_TIME_SIZE, RFC2822_FORMAT, now);
+			size_t len = strftime(data, MAX_TIME_SIZE - 1, cfg.timestamp_format, now);
+			//a format from the config file can't hold the newline ending the command
+			if(len > 0 && data[len - 1] != '\n')
+				data[len] = '\n';
 
 			rc = pthread_mutex_lock(&mutex);
 			if(rc != 0) {
@@ -575,6 +993,12 @@ int main(int argc, char* argv[]) {
 			rc = pthread_mutex_unlock(&mutex);
 		}
 		
+		/*------RELOAD SETTINGS------*/
+		if(caught_hup) {
+			caught_hup = 0; //clear it
+			reload_config(argc, argv);
+		}
+		
 		/*------MANAGE RUNNING THREADS------*/
 		slist_thread_t* tp = NULL;
 		slist_thread_t* next = NULL;
@@ -600,7 +1024,7 @@ int main(int argc, char* argv[]) {
 				//close the socket(s)
 				syslog(LOG_DEBUG, "Closed connection from %s\n", tdp->host);
 				close(tdp->nsfd); //close accepted socket	
-				if(USE_AESD_CHAR_DEVICE)
+				if(cfg.backend == BACKEND_CHAR)
 					close(tdp->fd); //close the driver	
 			
 				//free the thread
@@ -612,23 +1036,51 @@ int main(int argc, char* argv[]) {
 	}//end while
 	syslog(LOG_DEBUG, "Caught signal, exiting\n");
 	
-	if(result == -1) {
-		close(sfd);
-	}
+	//stop accepting, connections still in the backlog are refused
+	close(sfd);
+	
+	//drain: recv returns 0 from now on, commands already received are still written and echoed
+	slist_thread_t* tp = NULL;
+	SLIST_FOREACH(tp, &head, entries)
+		shutdown(tp->td->nsfd, SHUT_RD);
+	
+	struct timespec deadline;
+	deadline_after(&deadline, cfg.drain_timeout_ms);
+	int forced = 0;
+	int abandoned = 0;
 	
 	//free linked list
 	void* thread_rtn;
 	while(!SLIST_EMPTY(&head)) {
 		slist_thread_t* threadp = SLIST_FIRST(&head);
+		rc = pthread_timedjoin_np(threadp->thread, &thread_rtn, &deadline);
+		if(rc == ETIMEDOUT && !forced) {
+			//out of time, fail whatever the rest are blocked on
+			syslog(LOG_ERR, "Drain timed out, cutting off the remaining connections\n");
+			SLIST_FOREACH(tp, &head, entries)
+				shutdown(tp->td->nsfd, SHUT_RDWR);
+			deadline_after(&deadline, DRAIN_FORCE_MS);
+			forced = 1;
+			continue;
+		}
 		SLIST_REMOVE_HEAD(&head, entries);
-		pthread_join(threadp->thread, &thread_rtn);
+		if(rc == ETIMEDOUT) {
+			//stuck on something other than its socket, e.g. a blocking device read; exit ends it
+			syslog(LOG_ERR, "Abandoning the connection from %s, its thread didn't end\n", threadp->td->host);
+			abandoned++;
+			continue;
+		}
 		
 		//close the socket(s)
 		struct thread_data* tdp = (struct thread_data *) thread_rtn;
 		syslog(LOG_DEBUG, "Closed connection from %s\n", tdp->host);
 		close(tdp->nsfd); //close accepted socket	
-		if(USE_AESD_CHAR_DEVICE)
+		if(cfg.backend == BACKEND_CHAR) {
+			//commits staged commands and persists the history
+			if(fsync(tdp->fd) != 0 && errno != EINVAL)
+				syslog(LOG_ERR, "Failed to sync the driver:%m\n");
 			close(tdp->fd); //close the driver
+		}
 		
 		free(thread_rtn);
 		free(threadp);
@@ -638,12 +1090,17 @@ int main(int argc, char* argv[]) {
 	syslog(LOG_DEBUG, "Made it through the threads.\n");
 	
 	free(now);
-	pthread_mutex_destroy(&mutex);
+	//abandoned threads may still use the shared state, exiting frees it
+	if(!abandoned) {
+		pthread_mutex_destroy(&mutex);
+		if(cfg.backend == BACKEND_RING) ring_destroy();
+		if(cfg.buf_pool) bufpool_destroy();
+	}
 	 
-	if(!USE_AESD_CHAR_DEVICE) close(fd); //close writing file
-	close(sfd); //close socket
+	//no fsync, the file is removed right after
+	if(cfg.backend == BACKEND_FILE) close(fd); //close writing file
 	
-	if(!USE_AESD_CHAR_DEVICE) unlink(FILENAME); //remove file
+	if(cfg.backend == BACKEND_FILE) unlink(cfg.path); //remove file
 	closelog();
 	return result;
 }
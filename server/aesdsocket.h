@@ -8,6 +8,9 @@
 #ifndef AESDSOCKET_H_
 #define AESDSOCKET_H_
 //-------------------------INCLUDES-------------------------
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //for splice()
+#endif
 //Assignment 6 includes:
 #include <pthread.h>
 #include "queue.h"
@@ -26,35 +29,101 @@
 #include <signal.h>
 //assignment 9 includes:
 #include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdring.h"
+#include "bufpool.h"
+#include "affinity.h"
+#include "config.h"
+#include "../aesd-char-driver/aesd-newline.h"
 
 //-------------------------DEFINES-------------------------
+//The settings below are the defaults of struct aesd_config, see config.h
 #define S_PORT "9000"
 
 #define BACKLOG 5 //beej.us/guide/bgnet recommends 5 as number in backlog
 #define MAX_BUF_SIZE 50 //just to buffer
+#define RX_BUF_SIZE 4096 //least free space given to each recv, bounds a batch of pipelined commands
 #define RFC2822_FORMAT "timestamp:%a, %d %b %Y %T %z\n"
 #define MAX_TIME_SIZE 60
+#define TIMESTAMP_INTERVAL 10 //seconds
+
+//build with -DUSE_AESD_RING=1 to keep the data in an in-process aesd circular buffer
+#ifndef USE_AESD_RING
+#define USE_AESD_RING 0
+#endif
 
+#if USE_AESD_RING
+#define USE_AESD_CHAR_DEVICE 0
+#else
 #define USE_AESD_CHAR_DEVICE 1
+#endif
+
+
+//1: echo the file after every command, 0: once after each batch of pipelined commands
+#ifndef ECHO_PER_COMMAND
+#define ECHO_PER_COMMAND 0
+#endif
+
+//build with -DUSE_BUF_POOL=1 to take packet and echo buffers from a huge page backed pool
+#ifndef USE_BUF_POOL
+#define USE_BUF_POOL 0
+#endif
+#ifndef BUF_POOL_MLOCK
+#define BUF_POOL_MLOCK 0 //1 to also mlock the pool
+#endif
+#define BUF_POOL_BUF_SIZE 65536 //bytes per pool buffer, at least RX_BUF_SIZE
+#define BUF_POOL_COUNT 64 //two buffers per connection while it echoes
+
+//thread placement, -1 or 0 leaves it to the scheduler
+#ifndef ACCEPT_CPU
+#define ACCEPT_CPU -1 //CPU the accepting main thread is pinned to
+#endif
+#ifndef WORKER_NODE
+#define WORKER_NODE -1 //NUMA node whose CPUs run the connection threads
+#endif
+#ifndef WORKER_FOLLOW_RX_CPU
+#define WORKER_FOLLOW_RX_CPU 0 //1 pins each connection thread to the CPU receiving its packets
+#endif
+//the pool is faulted in by the acceptor, keep ACCEPT_CPU on WORKER_NODE so it is node local too
+
+#define DRAIN_TIMEOUT_MS 5000 //on SIGINT/SIGTERM, time given to connections to finish
+#define DRAIN_FORCE_MS 1000 //then time given to cut off connections to end before they are abandoned
+
+#define SPLICE_CHUNK 65536 //default pipe capacity, bytes moved per splice
 
 #define IOCTL_CMD "AESDCHAR_IOCSEEKTO"
 #define IOCTL_CMD_L 18
+#define IOCTL_MAX_L 64 //longest line parsed as an ioctl, "AESDCHAR_IOCSEEKTO:<u32>,<u32>\n" fits
+
+#define DEVICE_FILENAME "/dev/aesdchar"
+#define DATA_FILENAME "/var/tmp/aesdsocketdata" //backend file, a plain file with timestamps
 
 #undef FILENAME             /* undef it, just in case */
 #if USE_AESD_CHAR_DEVICE
-#    define FILENAME "/dev/aesdchar"
+#    define FILENAME DEVICE_FILENAME
 #else
      /* This one for user space */
-#    define FILENAME "/var/tmp/aesdsocketdata"
+#    define FILENAME DATA_FILENAME
 #endif
 
 
 //-------------------------GLOBALS-------------------------
 int caught_timer = 0;
 int caught_sig = 0;
+int caught_hup = 0;
 int sfd; //make socket global for shutdown
 
 //-------------------------STRUCTS-------------------------
+//Bytes received on a connection that haven't been written out yet
+struct rx_buffer {
+	char* data;
+	size_t start; //first byte not written yet
+	size_t len; //end of the received bytes
+	size_t cap; //size of data
+	//live settings copied when the connection is accepted, a reload never races with them
+	size_t want; //rx_buf_size
+	int echo_per_command;
+};
+
 /**
  * This structure should be dynamically allocated and passed as
  * an argument to your thread using pthread_create.
@@ -67,6 +136,7 @@ struct thread_data{
 	int fd; //file descriptor for the written file
 	int complete_flag; //1 if success, -1 if failure, 0 if not complete
 	char host[NI_MAXHOST]; //to hold the hostname per socket
+	struct rx_buffer rx; //partial command carried between packets
 };
 
 //Linked list of threads structure
@@ -83,7 +153,8 @@ struct slist_thread_s {
  *  This function will 
  *  - accept packets until the connection is closed.
  *  - write the packets to the specified file.  
- *  - echo back the file upon a packet reception.
+ *  - echo back the file upon a packet reception, or after every
+ *    command with ECHO_PER_COMMAND.
  * Input:
  *  thread_param = pointer to thread_data struct
  * Output:
@@ -0,0 +1,55 @@
+/* CPU and NUMA placement for aesdsocket
+ * Author: Madeleine Monfort
+ * Description:
+ *  Reads the NUMA topology from sysfs, so no libnuma is needed, and the
+ *  receiving CPU of a connection from the socket.
+ */
+
+#include "affinity.h" //first, it defines _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <syslog.h>
+
+#define CPULIST_PATH "/sys/devices/system/node/node%d/cpulist"
+#define CPULIST_MAX 4096
+
+int affinity_node_cpus(int node, cpu_set_t* set) {
+	char path[64];
+	char list[CPULIST_MAX];
+
+	snprintf(path, sizeof(path), CPULIST_PATH, node);
+	FILE* f = fopen(path, "r");
+	if(!f) {
+		syslog(LOG_ERR, "No NUMA node %d:%m\n", node);
+		return -1;
+	}
+	char* rc = fgets(list, sizeof(list), f);
+	fclose(f);
+	if(!rc)
+		return -1;
+
+	//cpulist is ranges like "0-3,8-11" or single CPUs
+	CPU_ZERO(set);
+	char* p = list;
+	while(*p >= '0' && *p <= '9') {
+		long first = strtol(p, &p, 10);
+		long last = first;
+		if(*p == '-')
+			last = strtol(p + 1, &p, 10);
+		for(long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, set);
+		if(*p == ',')
+			p++;
+	}
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+int affinity_incoming_cpu(int socket) {
+	int cpu = -1;
+	socklen_t len = sizeof(cpu);
+
+	if(getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0)
+		return -1;
+	return cpu;
+}
@@ -0,0 +1,32 @@
+/*
+ * affinity.h
+ *
+ *  Created on: Apr 29, 2024
+ *      Author: Madeleine Monfort
+ *
+ *  @brief CPU and NUMA node placement helpers for aesdsocket threads
+ */
+
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+//-------------------------INCLUDES-------------------------
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //cpu_set_t
+#endif
+#include <sched.h>
+
+//-------------------------FUNCTIONS-------------------------
+/* AFFINITY_NODE_CPUS
+ * Description: fills set with the CPUs of a NUMA node, from sysfs
+ * Output: 0 if successful, -1 if the node doesn't exist or has no CPUs
+ */
+int affinity_node_cpus(int node, cpu_set_t* set);
+
+/* AFFINITY_INCOMING_CPU
+ * Description: asks the kernel which CPU handled the last packets of a
+ *  connected socket (SO_INCOMING_CPU), the one its NIC queue interrupts
+ * Output: the CPU, -1 if unknown
+ */
+int affinity_incoming_cpu(int socket);
+
+#endif /* AFFINITY_H_ */
@@ -0,0 +1,129 @@
+/* I/O buffer pool for aesdsocket
+ * Author: Madeleine Monfort
+ * Description:
+ *  One anonymous mapping, prefaulted and backed by huge pages when possible,
+ *  split into fixed size buffers.  Free buffers sit on a global stack behind a
+ *  mutex; each thread keeps up to BUFPOOL_CACHE of them in a thread local
+ *  freelist and moves half of it to or from the global stack at a time.  Once
+ *  warmed up, getting and putting a buffer touches neither the allocator nor
+ *  the page tables, and usually not the mutex either.
+ */
+
+#define _GNU_SOURCE //MAP_HUGETLB, MADV_HUGEPAGE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "bufpool.h"
+
+#define BUFPOOL_CACHE 16 //buffers per thread freelist
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+static char* pool = NULL;
+static size_t pool_len = 0; //bytes mapped
+static size_t buf_size = 0;
+static size_t nr_bufs = 0;
+
+//global free stack
+static void** free_stack = NULL;
+static size_t nr_free = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//thread local freelist
+static __thread void* cache[BUFPOOL_CACHE];
+static __thread int nr_cached = 0;
+
+int bufpool_init(size_t size, size_t count, int flags) {
+	if(size == 0 || count == 0)
+		return -1;
+
+	pool_len = (size * count + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	pool = mmap(NULL, pool_len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if(pool == MAP_FAILED) {
+		//no reserved huge pages, ask for transparent ones before faulting in
+		pool = mmap(NULL, pool_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(pool == MAP_FAILED) {
+			syslog(LOG_ERR, "Failed to map the buffer pool:%m\n");
+			pool = NULL;
+			return -1;
+		}
+		if(madvise(pool, pool_len, MADV_HUGEPAGE) != 0)
+			syslog(LOG_DEBUG, "No transparent huge pages for the buffer pool:%m\n");
+		long page = sysconf(_SC_PAGESIZE);
+		for(size_t off = 0; off < pool_len; off += page)
+			pool[off] = 0;
+	}
+	if((flags & BUFPOOL_MLOCK) && mlock(pool, pool_len) != 0)
+		syslog(LOG_ERR, "Failed to mlock the buffer pool, continuing unlocked:%m\n");
+
+	free_stack = malloc(count * sizeof(*free_stack));
+	if(!free_stack) {
+		munmap(pool, pool_len);
+		pool = NULL;
+		return -1;
+	}
+	//lowest addresses on top, so a lightly loaded server stays in few pages
+	for(size_t i = 0; i < count; i++)
+		free_stack[i] = pool + (count - 1 - i) * size;
+	nr_free = count;
+	buf_size = size;
+	nr_bufs = count;
+	return 0;
+}
+
+void bufpool_destroy(void) {
+	bufpool_thread_exit();
+	if(pool) {
+		if(nr_free != nr_bufs)
+			syslog(LOG_ERR, "Buffer pool destroyed with %zu buffers in use\n", nr_bufs - nr_free);
+		munmap(pool, pool_len);
+	}
+	free(free_stack);
+	free_stack = NULL;
+	pool = NULL;
+	pool_len = buf_size = nr_bufs = nr_free = 0;
+}
+
+void* bufpool_get(void) {
+	if(nr_cached == 0 && pool) {
+		//refill half the freelist
+		pthread_mutex_lock(&pool_lock);
+		while(nr_cached < BUFPOOL_CACHE / 2 && nr_free > 0)
+			cache[nr_cached++] = free_stack[--nr_free];
+		pthread_mutex_unlock(&pool_lock);
+	}
+	return nr_cached ? cache[--nr_cached] : NULL;
+}
+
+void bufpool_put(void* buf) {
+	if(!buf)
+		return;
+	if(nr_cached == BUFPOOL_CACHE) {
+		//spill half the freelist
+		pthread_mutex_lock(&pool_lock);
+		while(nr_cached > BUFPOOL_CACHE / 2)
+			free_stack[nr_free++] = cache[--nr_cached];
+		pthread_mutex_unlock(&pool_lock);
+	}
+	cache[nr_cached++] = buf;
+}
+
+int bufpool_owns(const void* buf) {
+	return pool && (const char*)buf >= pool && (const char*)buf < pool + buf_size * nr_bufs;
+}
+
+size_t bufpool_buf_size(void) {
+	return buf_size;
+}
+
+void bufpool_thread_exit(void) {
+	if(nr_cached == 0)
+		return;
+	pthread_mutex_lock(&pool_lock);
+	while(nr_cached > 0)
+		free_stack[nr_free++] = cache[--nr_cached];
+	pthread_mutex_unlock(&pool_lock);
+}
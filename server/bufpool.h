@@ -0,0 +1,66 @@
+/*
+ * bufpool.h
+ *
+ *  Created on: Apr 28, 2024
+ *      Author: Madeleine Monfort
+ *
+ *  @brief Fixed size I/O buffers for aesdsocket, carved out of one huge page backed mapping
+ */
+
+#ifndef BUFPOOL_H_
+#define BUFPOOL_H_
+//-------------------------INCLUDES-------------------------
+#include <stddef.h>
+
+//-------------------------DEFINES-------------------------
+#define BUFPOOL_MLOCK 0x1 //lock the pool in RAM
+
+//-------------------------FUNCTIONS-------------------------
+/* BUFPOOL_INIT
+ * Description: maps nr_bufs buffers of buf_size bytes and faults them all in.
+ *  Explicit huge pages (MAP_HUGETLB) are used when the system has some
+ *  reserved, otherwise the mapping is offered to transparent huge pages.
+ * Input:
+ *  buf_size = bytes per buffer
+ *  nr_bufs = number of buffers
+ *  flags = BUFPOOL_MLOCK or 0
+ * Output: 0 if successful, -1 upon failure
+ */
+int bufpool_init(size_t buf_size, size_t nr_bufs, int flags);
+
+/* BUFPOOL_DESTROY
+ * Description: unmaps the pool, every buffer must have been put back
+ */
+void bufpool_destroy(void);
+
+/* BUFPOOL_GET
+ * Description: takes a buffer of bufpool_buf_size() bytes, from the calling
+ *  thread's freelist when it has one
+ * Output: the buffer, NULL if the pool is empty or not initialized
+ * Safety: thread safe
+ */
+void* bufpool_get(void);
+
+/* BUFPOOL_PUT
+ * Description: returns a buffer from bufpool_get() to the calling thread's freelist
+ * Safety: thread safe, any thread may put any pool buffer
+ */
+void bufpool_put(void* buf);
+
+/* BUFPOOL_OWNS
+ * Output: 1 if buf came from bufpool_get(), 0 otherwise (NULL included)
+ */
+int bufpool_owns(const void* buf);
+
+/* BUFPOOL_BUF_SIZE
+ * Output: bytes per buffer, 0 if the pool isn't initialized
+ */
+size_t bufpool_buf_size(void);
+
+/* BUFPOOL_THREAD_EXIT
+ * Description: gives the calling thread's cached buffers back to the pool,
+ *  call before a thread that used the pool exits
+ */
+void bufpool_thread_exit(void);
+
+#endif /* BUFPOOL_H_ */
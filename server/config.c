@@ -0,0 +1,235 @@
+/* Runtime configuration of aesdsocket
+ * Author: Madeleine Monfort
+ * Description:
+ *  One table describes every setting: its name, type, place in struct
+ *  aesd_config and whether SIGHUP may change it.  The config file parser,
+ *  the getopt_long options and the reload all work from that table.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "config.h"
+
+struct aesd_config cfg;
+
+enum setting_type { T_INT, T_UINT, T_SIZE, T_BOOL, T_STR, T_BACKEND }; //T_UINT: an int of at least 0
+
+struct setting {
+	const char* name;
+	enum setting_type type;
+	size_t offset;
+	size_t len; //size of the field
+	int live;
+	const char* help;
+};
+
+#define SETTING(name, type, live, help) \
+	{ #name, type, offsetof(struct aesd_config, name), sizeof(((struct aesd_config*)0)->name), live, help }
+
+static const struct setting settings[] = {
+	SETTING(port, T_STR, 0, "TCP port to listen on"),
+	SETTING(backlog, T_INT, 0, "listen() backlog"),
+	SETTING(backend, T_BACKEND, 0, "file, char or ring"),
+	SETTING(path, T_STR, 0, "data file or device"),
+	SETTING(buf_pool, T_BOOL, 0, "take I/O buffers from a huge page pool"),
+	SETTING(pool_buf_size, T_SIZE, 0, "bytes per pool buffer"),
+	SETTING(pool_count, T_SIZE, 0, "number of pool buffers"),
+	SETTING(pool_mlock, T_BOOL, 0, "mlock the pool"),
+	SETTING(accept_cpu, T_INT, 0, "CPU for the accepting thread, -1 for any"),
+	SETTING(worker_node, T_INT, 0, "NUMA node for connection threads, -1 for any"),
+	SETTING(rx_buf_size, T_SIZE, 1, "least free space given to each recv"),
+	SETTING(echo_per_command, T_BOOL, 1, "echo after every command instead of every batch"),
+	SETTING(worker_follow_rx_cpu, T_BOOL, 1, "pin connection threads to their receiving CPU"),
+	SETTING(drain_timeout_ms, T_UINT, 1, "time connections get to finish on shutdown"),
+	SETTING(timestamp_interval, T_UINT, 1, "seconds between timestamps in file mode, 0 for none"),
+	SETTING(timestamp_format, T_STR, 1, "strftime format of the timestamps"),
+};
+#define NR_SETTINGS (sizeof(settings) / sizeof(settings[0]))
+
+static const char* backend_names[] = { "file", "char", "ring" };
+
+static const struct setting* find_setting(const char* name) {
+	for(size_t i = 0; i < NR_SETTINGS; i++) {
+		if(strcmp(settings[i].name, name) == 0)
+			return &settings[i];
+	}
+	return NULL;
+}
+
+int config_set(struct aesd_config* c, const char* name, const char* value) {
+	const struct setting* s = find_setting(name);
+	char* field;
+	char* end;
+
+	if(!s) {
+		syslog(LOG_ERR, "Unknown setting %s\n", name);
+		return -1;
+	}
+	field = (char*)c + s->offset;
+	errno = 0;
+	switch(s->type) {
+		case T_INT:
+		case T_UINT: {
+			long v = strtol(value, &end, 0);
+			if(errno || end == value || *end || v < (s->type == T_UINT ? 0 : INT_MIN) || v > INT_MAX)
+				goto bad;
+			*(int*)field = v;
+			break;
+		}
+		case T_SIZE: {
+			unsigned long long v = strtoull(value, &end, 0);
+			if(errno || end == value || *end || value[0] == '-' || v == 0)
+				goto bad;
+			*(size_t*)field = v;
+			break;
+		}
+		case T_BOOL:
+			if(!strcmp(value, "1") || !strcmp(value, "yes") || !strcmp(value, "true"))
+				*(int*)field = 1;
+			else if(!strcmp(value, "0") || !strcmp(value, "no") || !strcmp(value, "false"))
+				*(int*)field = 0;
+			else
+				goto bad;
+			break;
+		case T_STR:
+			if(strlen(value) >= s->len)
+				goto bad;
+			strcpy(field, value);
+			break;
+		case T_BACKEND: {
+			size_t b;
+			for(b = 0; b < sizeof(backend_names) / sizeof(backend_names[0]); b++) {
+				if(!strcmp(value, backend_names[b]))
+					break;
+			}
+			if(b == sizeof(backend_names) / sizeof(backend_names[0]))
+				goto bad;
+			*(enum aesd_backend*)field = b;
+			break;
+		}
+	}
+	return 0;
+
+bad:
+	syslog(LOG_ERR, "Bad value for %s: %s\n", name, value);
+	return -1;
+}
+
+/* TRIM
+ * Description: strips leading and trailing blanks in place
+ * Output: the start of the trimmed string
+ */
+static char* trim(char* s) {
+	while(*s == ' ' || *s == '\t')
+		s++;
+	char* end = s + strlen(s);
+	while(end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	*end = '\0';
+	return s;
+}
+
+int config_load_file(struct aesd_config* c, const char* path) {
+	char line[PATH_MAX + CONFIG_STR_MAX];
+	int result = 0;
+	int lineno = 0;
+
+	FILE* f = fopen(path, "r");
+	if(!f) {
+		syslog(LOG_ERR, "Failed to open config %s:%m\n", path);
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f)) {
+		lineno++;
+		char* hash = strchr(line, '#');
+		if(hash)
+			*hash = '\0';
+		char* name = trim(line);
+		if(*name == '\0')
+			continue;
+		char* eq = strchr(name, '=');
+		if(!eq) {
+			syslog(LOG_ERR, "%s:%d: expected name = value\n", path, lineno);
+			result = -1;
+			continue;
+		}
+		*eq = '\0';
+		if(config_set(c, trim(name), trim(eq + 1)) != 0)
+			result = -1;
+	}
+	fclose(f);
+	return result;
+}
+
+static void usage(const char* prog) {
+	printf("Usage: %s [-d] [-c config file] [--name value]...\n", prog);
+	printf("  -d  run as a daemon\n  -c  config file, default %s if it exists\n", CONFIG_DEFAULT_FILE);
+	for(size_t i = 0; i < NR_SETTINGS; i++)
+		printf("  --%-22s %s%s\n", settings[i].name, settings[i].help, settings[i].live ? " (live)" : "");
+}
+
+int config_parse_args(struct aesd_config* c, int argc, char* argv[], const char** file, int* daemon) {
+	struct option options[NR_SETTINGS + 1];
+	int result = 0;
+	int opt;
+	int index;
+
+	for(size_t i = 0; i < NR_SETTINGS; i++) {
+		options[i].name = settings[i].name;
+		options[i].has_arg = required_argument;
+		options[i].flag = NULL;
+		options[i].val = 0;
+	}
+	memset(&options[NR_SETTINGS], 0, sizeof(options[NR_SETTINGS]));
+
+	optind = 0; //restart, argv is parsed again on every reload
+	while((opt = getopt_long(argc, argv, "dc:h", options, &index)) != -1) {
+		switch(opt) {
+			case 0:
+				if(config_set(c, options[index].name, optarg) != 0)
+					result = -1;
+				break;
+			case 'd':
+				*daemon = 1;
+				break;
+			case 'c':
+				*file = optarg;
+				break;
+			case 'h':
+				usage(argv[0]);
+				return 1;
+			default:
+				syslog(LOG_ERR, "ERROR: incorrect arguments.\n");
+				usage(argv[0]);
+				return -1;
+		}
+	}
+	if(optind < argc) {
+		syslog(LOG_ERR, "ERROR: unexpected argument %s\n", argv[optind]);
+		usage(argv[0]);
+		result = -1;
+	}
+	return result;
+}
+
+void config_apply_live(const struct aesd_config* fresh) {
+	for(size_t i = 0; i < NR_SETTINGS; i++) {
+		const struct setting* s = &settings[i];
+		char* cur = (char*)&cfg + s->offset;
+		const char* new = (const char*)fresh + s->offset;
+
+		//strings may hold stale bytes past their terminator
+		if(s->type == T_STR ? strcmp(cur, new) == 0 : memcmp(cur, new, s->len) == 0)
+			continue;
+		if(!s->live) {
+			syslog(LOG_INFO, "Setting %s changes on restart only\n", s->name);
+			continue;
+		}
+		memcpy(cur, new, s->len);
+		syslog(LOG_INFO, "Reloaded %s\n", s->name);
+	}
+}
@@ -0,0 +1,89 @@
+/*
+ * config.h
+ *
+ *  Created on: Apr 30, 2024
+ *      Author: Madeleine Monfort
+ *
+ *  @brief Runtime settings of aesdsocket, from a config file and the command line
+ *
+ *  Every setting has one name, used both as the config file key
+ *  ("name = value", '#' starts a comment) and as the long option (--name value).
+ *  The compile time defines in aesdsocket.h are the defaults.  Command line
+ *  options override the file.  On SIGHUP the file and command line are read
+ *  again and only the settings marked live below are applied; the others need
+ *  a restart.
+ */
+
+#ifndef CONFIG_H_
+#define CONFIG_H_
+//-------------------------INCLUDES-------------------------
+#include <limits.h>
+#include <stddef.h>
+
+//-------------------------DEFINES-------------------------
+#define CONFIG_STR_MAX 128
+#define CONFIG_DEFAULT_FILE "/etc/aesdsocket.conf"
+
+//-------------------------STRUCTS-------------------------
+enum aesd_backend {
+	BACKEND_FILE, //plain file with timestamps
+	BACKEND_CHAR, //aesd char driver
+	BACKEND_RING, //in-process aesd circular buffer
+};
+
+struct aesd_config {
+	//fixed once the server runs
+	char port[CONFIG_STR_MAX];
+	int backlog;
+	enum aesd_backend backend;
+	char path[PATH_MAX]; //data file or device
+	int buf_pool; //take I/O buffers from the huge page pool
+	size_t pool_buf_size;
+	size_t pool_count;
+	int pool_mlock;
+	int accept_cpu; //-1 unpinned
+	int worker_node; //-1 any node
+	//live, reloaded on SIGHUP
+	size_t rx_buf_size; //least free space given to each recv, copied per connection on accept
+	int echo_per_command; //copied per connection on accept
+	int worker_follow_rx_cpu;
+	int drain_timeout_ms;
+	int timestamp_interval; //seconds between timestamps in file mode, 0 for none
+	char timestamp_format[CONFIG_STR_MAX]; //strftime format
+};
+
+//-------------------------GLOBALS-------------------------
+extern struct aesd_config cfg; //settings in effect
+
+//-------------------------FUNCTIONS-------------------------
+/* CONFIG_SET
+ * Description: parses value into the setting called name
+ * Output: 0 if successful, -1 for an unknown name or a bad value (logged)
+ */
+int config_set(struct aesd_config* c, const char* name, const char* value);
+
+/* CONFIG_LOAD_FILE
+ * Description: applies every "name = value" line of the file at path
+ * Output: 0 if successful, -1 if the file can't be read or has a bad line
+ */
+int config_load_file(struct aesd_config* c, const char* path);
+
+/* CONFIG_PARSE_ARGS
+ * Description: applies the command line.  Besides the --name value options:
+ *  -d runs as a daemon, -c file reads the config file first, -h prints usage.
+ *  Can be called again on the same argv, e.g. for a reload.
+ * Input:
+ *  c = settings to update
+ *  file = set to the -c argument, left untouched without one
+ *  daemon = set to 1 with -d
+ * Output: 0 if successful, -1 upon a bad option, 1 if usage was printed
+ */
+int config_parse_args(struct aesd_config* c, int argc, char* argv[], const char** file, int* daemon);
+
+/* CONFIG_APPLY_LIVE
+ * Description: copies the live settings of fresh into cfg, logging the changes
+ *  and the fixed settings that differ, which are ignored until a restart
+ */
+void config_apply_live(const struct aesd_config* fresh);
+
+#endif /* CONFIG_H_ */
@@ -0,0 +1,587 @@
+/* Checks of the aesdchar driver features that the shell can't reach, run by
+ * aesd-char-driver/aesdchar_helper.sh with the module loaded the way each
+ * check needs it: ./driverTest <check> [arg]
+ * Each check starts from an empty device and prints a line on failure.
+ */
+#define _GNU_SOURCE //sched_setaffinity()
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdsocket.h"
+
+static const char* check_arg; //optional second argument of the check
+
+#define FAIL(...) do { printf("FAIL: " __VA_ARGS__); printf("\n"); return -1; } while(0)
+
+/* WRITE_CMD
+ * writes str to the device in one write()
+ */
+static int write_cmd(int fd, const char* str) {
+	ssize_t len = strlen(str);
+	if(write(fd, str, len) != len) {
+		printf("ERROR writing %s:%m\n", str);
+		return -1;
+	}
+	return 0;
+}
+
+/* READ_ALL
+ * reads everything the device holds into buf, NUL terminated
+ * returns the number of bytes read, or -1
+ */
+static ssize_t read_all(int fd, char* buf, size_t cap) {
+	size_t len = 0;
+	ssize_t rc;
+
+	if(lseek(fd, 0, SEEK_SET) != 0) {
+		printf("ERROR seeking:%m\n");
+		return -1;
+	}
+	while(len < cap - 1 && (rc = read(fd, buf + len, cap - 1 - len)) > 0)
+		len += rc;
+	if(rc < 0) {
+		printf("ERROR reading:%m\n");
+		return -1;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+/* MMAP
+ * reads the entries back through the mapping, before and after their slots
+ * are reused
+ */
+static int check_mmap(int fd) {
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct aesd_mmap_header hdr;
+	volatile struct aesd_mmap_header* live;
+	char expect[32];
+	size_t map_len;
+	uint32_t seq;
+	char* map;
+	int i;
+
+	if(write_cmd(fd, "one\n") || write_cmd(fd, "two\n"))
+		return -1;
+
+	live = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(live == MAP_FAILED)
+		FAIL("mmap of the header:%m");
+	memcpy(&hdr, (void*)live, sizeof(hdr));
+	munmap((void*)live, page_size);
+	if(hdr.magic != AESD_MMAP_MAGIC || hdr.version != AESD_MMAP_VERSION)
+		FAIL("header magic %x version %u", hdr.magic, hdr.version);
+	if(hdr.slots == 0 || hdr.slots > AESD_MMAP_MAX_SLOTS || hdr.page_size != page_size)
+		FAIL("header slots %u page_size %u", hdr.slots, hdr.page_size);
+	if(hdr.count != 2 || hdr.slot_size[hdr.out_offs] != 4)
+		FAIL("header count %u first size %lu", hdr.count,
+			(unsigned long)hdr.slot_size[hdr.out_offs]);
+
+	map_len = (1 + (size_t)hdr.slots * hdr.window_pages) * page_size;
+	map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+		FAIL("mmap of the windows:%m");
+	live = (void*)map;
+
+	for(i = 0; i < 2; i++) {
+		char* window = map + (1 + (size_t)((hdr.out_offs + i) % hdr.slots) * hdr.window_pages) * page_size;
+		if(memcmp(window, i ? "two\n" : "one\n", 4))
+			FAIL("window of entry %d", i);
+	}
+
+	//fill the ring twice over so every slot's window is replaced while mapped
+	for(i = 0; i < 2 * (int)hdr.slots; i++) {
+		snprintf(expect, sizeof(expect), "cmd %d\n", i);
+		seq = live->seq;
+		if(write_cmd(fd, expect))
+			return -1;
+		if(live->seq == seq)
+			FAIL("header seq didn't change after a write");
+	}
+
+	//entries one and two were faulted in before their slots were reused
+	do {
+		seq = live->seq;
+		memcpy(&hdr, (void*)live, sizeof(hdr));
+	} while((seq & 1) || live->seq != seq);
+	if(hdr.count != hdr.slots)
+		FAIL("header count %u of %u slots", hdr.count, hdr.slots);
+	for(i = 0; i < (int)hdr.count; i++) {
+		uint32_t slot = (hdr.out_offs + i) % hdr.slots;
+		snprintf(expect, sizeof(expect), "cmd %d\n", (int)hdr.slots + i);
+		if(hdr.slot_size[slot] != strlen(expect) ||
+				memcmp(map + (1 + (size_t)slot * hdr.window_pages) * page_size, expect, strlen(expect)))
+			FAIL("entry %d through a reused window", i);
+	}
+
+	munmap(map, map_len);
+	return 0;
+}
+
+/* FOLLOW
+ * a following file blocks for new commands across evictions, while fd keeps
+ * the plain ring positions and end of file
+ */
+static int check_follow(int fd) {
+	uint32_t on = 1;
+	char buf[512];
+	int lines = 0;
+	ssize_t rc;
+	pid_t pid;
+	int status;
+	int i;
+
+	pid = fork();
+	if(pid == -1)
+		FAIL("fork:%m");
+	if(pid == 0) {
+		int ffd = open(FILENAME, O_RDONLY);
+		if(ffd == -1 || ioctl(ffd, AESDCHAR_IOCFOLLOW, &on))
+			_exit(2);
+		alarm(5);
+		while(lines < 15 && (rc = read(ffd, buf, sizeof(buf))) > 0) {
+			for(i = 0; i < rc; i++)
+				lines += buf[i] == '\n';
+		}
+		_exit(lines == 15 ? 0 : 1);
+	}
+
+	usleep(200000);
+	for(i = 1; i <= 15; i++) {
+		snprintf(buf, sizeof(buf), "follow %d\n", i);
+		if(write_cmd(fd, buf))
+			return -1;
+		usleep(20000);
+	}
+	if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+		FAIL("follower didn't read the 15 commands");
+
+	//fd doesn't follow: position 0 is the oldest command left, then end of file
+	rc = read(fd, buf, sizeof(buf) - 1);
+	if(rc <= 0)
+		FAIL("read of the ring:%m");
+	buf[rc] = '\0';
+	if(strncmp(buf, "follow 6\n", 9))
+		FAIL("ring starts with %.10s", buf);
+	if(read(fd, buf, sizeof(buf)) != 0)
+		FAIL("no end of file without follow");
+
+	//a non-blocking follower gets EAGAIN at the end instead
+	int nfd = open(FILENAME, O_RDONLY | O_NONBLOCK);
+	if(nfd == -1 || ioctl(nfd, AESDCHAR_IOCFOLLOW, &on))
+		FAIL("follow ioctl:%m");
+	while(read(nfd, buf, sizeof(buf)) > 0)
+		;
+	rc = errno;
+	close(nfd);
+	if(rc != EAGAIN)
+		FAIL("non-blocking follower got errno %zd", rc);
+	return 0;
+}
+
+/* INDEX
+ * the AESDCHAR_IOCGETINDEX snapshot lists the commands oldest first, back to
+ * back, before and after the ring wraps
+ */
+static int check_index(int fd) {
+	struct aesd_index index;
+	uint64_t offset = 0;
+	char buf[32];
+	uint32_t i;
+
+	for(i = 0; i < 3; i++) {
+		snprintf(buf, sizeof(buf), "%.*s\n", (int)i + 1, "abc");
+		if(write_cmd(fd, buf))
+			return -1;
+	}
+	if(ioctl(fd, AESDCHAR_IOCGETINDEX, &index))
+		FAIL("AESDCHAR_IOCGETINDEX:%m");
+	if(index.count != 3 || index.total_size != 2 + 3 + 4 || index.generation != 3)
+		FAIL("count %u total_size %lu generation %lu", index.count,
+			(unsigned long)index.total_size, (unsigned long)index.generation);
+	for(i = 0; i < 3; i++) {
+		if(index.entry[i].offset != offset || index.entry[i].size != i + 2 ||
+				index.entry[i].seq != i)
+			FAIL("entry %u", i);
+		offset += index.entry[i].size;
+	}
+
+	//wrap the ring, the snapshot then starts at the oldest command left
+	for(i = 0; i < 2 * AESD_INDEX_MAX_ENTRIES && index.entry[0].size != 5; i++) {
+		if(write_cmd(fd, "wrap\n") || ioctl(fd, AESDCHAR_IOCGETINDEX, &index))
+			FAIL("write or AESDCHAR_IOCGETINDEX:%m");
+	}
+	if(index.count == 0 || index.count > AESD_INDEX_MAX_ENTRIES)
+		FAIL("count %u after wrapping", index.count);
+	offset = 0;
+	for(i = 0; i < index.count; i++) {
+		if(index.entry[i].offset != offset || index.entry[i].size != 5 ||
+				index.entry[i].seq != index.next_seq - index.count + i)
+			FAIL("entry %u after wrapping", i);
+		offset += index.entry[i].size;
+	}
+	if(index.total_size != offset)
+		FAIL("total_size %lu after wrapping", (unsigned long)index.total_size);
+	return 0;
+}
+
+/* PIN
+ * moves the calling process to cpu, modulo the CPUs available
+ */
+static void pin(int cpu) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	sched_setaffinity(0, sizeof(set), &set);
+}
+
+/* PCPU
+ * with percpu_batch set, commands staged on different CPUs are still read
+ * back in the order they were written, by one writer moving between CPUs
+ * and by concurrent writers
+ */
+static int check_pcpu(int fd) {
+	struct aesd_index index;
+	char buf[4096];
+	int last[4] = { -1, -1, -1, -1 };
+	char* line;
+	int w, k, i;
+	int status;
+
+	//one writer hopping CPUs: the ring holds the newest commands in order
+	for(i = 0; i < 100; i++) {
+		pin(i);
+		snprintf(buf, sizeof(buf), "hop %d\n", i);
+		if(write_cmd(fd, buf))
+			return -1;
+	}
+	if(read_all(fd, buf, sizeof(buf)) < 0 || ioctl(fd, AESDCHAR_IOCGETINDEX, &index))
+		return -1;
+	if(index.next_seq != 100)
+		FAIL("next_seq %lu after 100 commands", (unsigned long)index.next_seq);
+	i = 100 - index.count;
+	for(line = strtok(buf, "\n"); line; line = strtok(NULL, "\n"), i++) {
+		if(sscanf(line, "hop %d", &k) != 1 || k != i)
+			FAIL("read %s where hop %d was expected", line, i);
+	}
+	if(i != 100)
+		FAIL("ring ends at hop %d", i - 1);
+
+	//concurrent writers on their own CPUs: each one's commands stay in its order
+	for(w = 0; w < 4; w++) {
+		if(fork() == 0) {
+			pin(w);
+			for(k = 0; k < 200; k++) {
+				snprintf(buf, sizeof(buf), "w%d %d\n", w, k);
+				if(write_cmd(fd, buf))
+					_exit(1);
+			}
+			_exit(0);
+		}
+	}
+	for(w = 0; w < 4; w++) {
+		if(wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+			FAIL("writer failed");
+	}
+	if(read_all(fd, buf, sizeof(buf)) < 0 || ioctl(fd, AESDCHAR_IOCGETINDEX, &index))
+		return -1;
+	if(index.next_seq != 100 + 4 * 200)
+		FAIL("next_seq %lu after the concurrent writers", (unsigned long)index.next_seq);
+	for(i = 0; i < (int)index.count; i++) {
+		if(index.entry[i].seq != index.next_seq - index.count + i)
+			FAIL("index entry %d out of sequence", i);
+	}
+	for(line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+		if(sscanf(line, "w%d %d", &w, &k) != 2 || w < 0 || w > 3 || k <= last[w])
+			FAIL("read %s out of order", line);
+		last[w] = k;
+	}
+	return 0;
+}
+
+/* PERSIST_WRITE
+ * writes 12 commands numbered by their sequence number and syncs them to the
+ * segment files
+ */
+static int check_persist_write(int fd) {
+	struct aesd_index index;
+	char buf[32];
+	int i;
+
+	if(ioctl(fd, AESDCHAR_IOCGETINDEX, &index))
+		FAIL("AESDCHAR_IOCGETINDEX:%m");
+	for(i = 0; i < 12; i++) {
+		snprintf(buf, sizeof(buf), "persist %lu\n", (unsigned long)index.next_seq + i);
+		if(write_cmd(fd, buf))
+			return -1;
+	}
+	if(fsync(fd))
+		FAIL("fsync:%m");
+	return 0;
+}
+
+/* PERSIST_READ
+ * after a reload, the ring holds the newest commands written by
+ * persist-write, with their sequence numbers, and the next command number is
+ * the one given as argument
+ */
+static int check_persist_read(int fd) {
+	struct aesd_index index;
+	unsigned long seq;
+	char buf[4096];
+	char* line;
+	uint32_t i = 0;
+
+	if(!check_arg)
+		FAIL("expected next_seq missing");
+	if(read_all(fd, buf, sizeof(buf)) < 0 || ioctl(fd, AESDCHAR_IOCGETINDEX, &index))
+		return -1;
+	if(index.next_seq != strtoul(check_arg, NULL, 0) || index.count == 0)
+		FAIL("next_seq %lu count %u after reload", (unsigned long)index.next_seq, index.count);
+	for(line = strtok(buf, "\n"); line; line = strtok(NULL, "\n"), i++) {
+		if(i >= index.count || sscanf(line, "persist %lu", &seq) != 1 ||
+				seq != index.entry[i].seq || seq != index.next_seq - index.count + i)
+			FAIL("read %s as entry %u", line, i);
+	}
+	if(i != index.count)
+		FAIL("read %u of %u commands", i, index.count);
+	return 0;
+}
+
+/* SEEKTO
+ * with max_bytes evicting commands, AESDCHAR_IOCSEEKTO still addresses only
+ * the commands left once the ring wraps past them
+ */
+static int check_seekto(int fd) {
+	struct aesd_seekto seekto;
+	struct aesd_index index;
+	char buf[32];
+	ssize_t rc;
+	int i;
+
+	for(i = 0; i < 12; i++) {
+		snprintf(buf, sizeof(buf), "cmd %d\n", i);
+		if(write_cmd(fd, buf))
+			return -1;
+	}
+	if(ioctl(fd, AESDCHAR_IOCGETINDEX, &index))
+		FAIL("AESDCHAR_IOCGETINDEX:%m");
+	if(index.count == 0 || index.count >= 10)
+		FAIL("budget left %u commands", index.count);
+
+	seekto.write_cmd = index.count;
+	seekto.write_cmd_offset = 0;
+	if(ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == 0 || errno != EINVAL)
+		FAIL("seek to command %u of %u", index.count, index.count);
+	seekto.write_cmd = index.count - 1;
+	seekto.write_cmd_offset = 2;
+	if(ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto))
+		FAIL("seek into the newest command:%m");
+	rc = read(fd, buf, sizeof(buf) - 1);
+	if(rc != 5 || memcmp(buf, "d 11\n", 5))
+		FAIL("read %zd bytes after the seek", rc);
+	seekto.write_cmd = 0;
+	seekto.write_cmd_offset = 8;
+	if(ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == 0 || errno != EINVAL)
+		FAIL("seek past the end of the oldest command");
+	return 0;
+}
+
+/* SEEK_SEQ
+ * calls AESDCHAR_IOCSEEKSEQ, returns its result with errno on failure
+ */
+static int seek_seq(int fd, struct aesd_seekseq* seekseq, int64_t seq, uint32_t offset, uint32_t flags) {
+	seekseq->seq = seq;
+	seekseq->offset = offset;
+	seekseq->flags = flags;
+	return ioctl(fd, AESDCHAR_IOCSEEKSEQ, seekseq);
+}
+
+/* SEEKSEQ
+ * AESDCHAR_IOCSEEKSEQ by absolute and relative sequence number, for commands
+ * held, evicted and not written yet
+ */
+static int check_seekseq(int fd) {
+	struct aesd_seekseq seekseq;
+	char buf[32];
+	ssize_t rc;
+	int i;
+
+	//the ring holds commands 5 to 14
+	for(i = 0; i < 15; i++) {
+		snprintf(buf, sizeof(buf), "seq %d\n", i);
+		if(write_cmd(fd, buf))
+			return -1;
+	}
+
+	if(seek_seq(fd, &seekseq, 7, 4, 0) || seekseq.seq != 7)
+		FAIL("absolute seek to 7:%m");
+	rc = read(fd, buf, 2);
+	if(rc != 2 || memcmp(buf, "7\n", 2))
+		FAIL("read after the absolute seek");
+
+	//the position is now at the start of command 8
+	if(seek_seq(fd, &seekseq, 2, 0, AESD_SEEKSEQ_RELATIVE) || seekseq.seq != 10)
+		FAIL("relative seek by 2 to seq %lu:%m", (unsigned long)seekseq.seq);
+	rc = read(fd, buf, 7);
+	if(rc != 7 || memcmp(buf, "seq 10\n", 7))
+		FAIL("read after the relative seek");
+	if(seek_seq(fd, &seekseq, -3, 0, AESD_SEEKSEQ_RELATIVE) || seekseq.seq != 8)
+		FAIL("relative seek by -3 to seq %lu:%m", (unsigned long)seekseq.seq);
+
+	if(seek_seq(fd, &seekseq, 3, 0, 0) == 0 || errno != ENODATA)
+		FAIL("seek to evicted command 3 didn't fail with ENODATA");
+	if(seek_seq(fd, &seekseq, 15, 0, 0) || read(fd, buf, sizeof(buf)) != 0)
+		FAIL("seek to the end of the data:%m");
+	if(seek_seq(fd, &seekseq, 15, 1, 0) == 0 || errno != EINVAL)
+		FAIL("seek past the end of the data didn't fail with EINVAL");
+	if(seek_seq(fd, &seekseq, 16, 0, 0) == 0 || errno != EINVAL)
+		FAIL("seek to a command not written didn't fail with EINVAL");
+	if(seek_seq(fd, &seekseq, 14, 8, 0) == 0 || errno != EINVAL)
+		FAIL("seek past the end of command 14 didn't fail with EINVAL");
+	return 0;
+}
+
+/* FILL_CMD
+ * fills len bytes of buf with a command ending in '\n', compressible text or
+ * pseudo-random bytes
+ */
+static void fill_cmd(char* buf, size_t len, int random) {
+	unsigned int x = 12345;
+	size_t i;
+
+	for(i = 0; i < len - 1; i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = random ? (char)((x >> 16) | 0x80) : "compressible "[i % 13];
+	}
+	buf[len - 1] = '\n';
+}
+
+/* COMPRESS
+ * commands stored compressed read back unchanged, whole and in small reads
+ * across chunk boundaries, with an incompressible one kept as it is
+ */
+static int check_compress(int fd) {
+	static const size_t sizes[] = { 3 * 4096 + 100, 2 * 4096, 5000, 6 };
+	static char expect[32768];
+	static char got[32768];
+	size_t total = 0;
+	size_t i, pos;
+	ssize_t rc;
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fill_cmd(expect + total, sizes[i], i == 2);
+		if(write(fd, expect + total, sizes[i]) != (ssize_t)sizes[i])
+			FAIL("write of %zu bytes:%m", sizes[i]);
+		total += sizes[i];
+	}
+	rc = read_all(fd, got, sizeof(got));
+	if(rc != (ssize_t)total || memcmp(got, expect, total))
+		FAIL("read %zd of %zu bytes back", rc, total);
+
+	//odd sized reads straddle the chunk and command boundaries
+	for(pos = 0; pos < total; pos += 1000) {
+		if(lseek(fd, pos, SEEK_SET) != (off_t)pos)
+			FAIL("lseek to %zu:%m", pos);
+		rc = read(fd, got, 1500);
+		if(rc <= 0 || memcmp(got, expect + pos, rc))
+			FAIL("read of 1500 bytes at %zu", pos);
+	}
+	return 0;
+}
+
+/* SPLICE
+ * splice() from the device moves the same bytes read() returns, across page
+ * and command boundaries and from an offset
+ */
+static int check_splice(int fd) {
+	static const size_t sizes[] = { 5 * 4096 + 10, 100, 4096 };
+	static char expect[32768];
+	static char got[32768];
+	size_t total = 0;
+	size_t len = 0;
+	loff_t off = 0;
+	int pipefd[2];
+	ssize_t rc;
+	size_t i;
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fill_cmd(expect + total, sizes[i], 0);
+		if(write(fd, expect + total, sizes[i]) != (ssize_t)sizes[i])
+			FAIL("write of %zu bytes:%m", sizes[i]);
+		total += sizes[i];
+	}
+	if(pipe(pipefd))
+		FAIL("pipe:%m");
+
+	//a pipe holds 16 pages by default, drain it between splices
+	while((rc = splice(fd, &off, pipefd[1], NULL, 8192, 0)) > 0) {
+		while(rc > 0) {
+			ssize_t n = read(pipefd[0], got + len, rc);
+			if(n <= 0)
+				FAIL("read from the pipe:%m");
+			len += n;
+			rc -= n;
+		}
+	}
+	if(rc < 0)
+		FAIL("splice:%m");
+	if(len != total || off != (loff_t)total || memcmp(got, expect, total))
+		FAIL("spliced %zu of %zu bytes", len, total);
+
+	//from the middle of the first command's last page into the next command
+	off = 5 * 4096 - 50;
+	rc = splice(fd, &off, pipefd[1], NULL, 200, 0);
+	if(rc != 200 || read(pipefd[0], got, 200) != 200 || memcmp(got, expect + 5 * 4096 - 50, 200))
+		FAIL("splice of 200 bytes from an offset returned %zd", rc);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return 0;
+}
+
+static const struct {
+	const char* name;
+	int (*run)(int fd);
+} checks[] = {
+	{ "mmap", check_mmap },
+	{ "follow", check_follow },
+	{ "index", check_index },
+	{ "pcpu", check_pcpu },
+	{ "seekto", check_seekto },
+	{ "seekseq", check_seekseq },
+	{ "compress", check_compress },
+	{ "splice", check_splice },
+	{ "persist-write", check_persist_write },
+	{ "persist-read", check_persist_read },
+};
+
+int main(int argc, char** argv) {
+	int result = -1;
+	size_t i;
+
+	if(argc < 2 || argc > 3) {
+		printf("usage: %s <check> [arg]\n", argv[0]);
+		return 1;
+	}
+	check_arg = argc == 3 ? argv[2] : NULL;
+	for(i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+		if(strcmp(argv[1], checks[i].name))
+			continue;
+		int fd = open(FILENAME, O_RDWR);
+		if(fd == -1) {
+			printf("ERROR opening file:%m\n");
+			return 1;
+		}
+		result = checks[i].run(fd);
+		close(fd);
+		printf("%s: %s\n", checks[i].name, result ? "FAIL" : "PASS");
+		return result ? 1 : 0;
+	}
+	printf("unknown check %s\n", argv[1]);
+	return 1;
+}
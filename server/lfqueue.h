@@ -0,0 +1,233 @@
+/*
+ * lfqueue.h
+ *
+ *  Created on: Apr 27, 2024
+ *      Author: Madeleine Monfort
+ *
+ *  @brief Bounded lock-free pointer queues for handing work between threads
+ *
+ *  queue.h only has intrusive lists, which need a mutex once two threads touch
+ *  them.  These are fixed size rings of void* built on C11 atomics:
+ *   - lfq_spsc: one producer thread, one consumer thread, wait free.
+ *   - lfq_mpsc: any number of producer threads, one consumer thread.  Producers
+ *     claim slots with a compare and swap on the tail, the consumer never
+ *     waits on a lock, only on a producer that has claimed a slot but not
+ *     filled it yet.
+ *  The producer and consumer indices live on separate cache lines so the two
+ *  sides don't invalidate each other's line on every operation.  Both queues
+ *  take and return batches, so a burst costs one index update.
+ *
+ *  Capacities must be a power of two.  NULL can't be queued.
+ */
+
+#ifndef LFQUEUE_H_
+#define LFQUEUE_H_
+//-------------------------INCLUDES-------------------------
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+//-------------------------DEFINES-------------------------
+#define LFQ_CACHELINE 64
+
+//-------------------------STRUCTS-------------------------
+struct lfq_spsc {
+	//consumer side
+	_Alignas(LFQ_CACHELINE) atomic_size_t head; //next slot to pop
+	size_t tail_cache; //last tail seen by the consumer
+	//producer side
+	_Alignas(LFQ_CACHELINE) atomic_size_t tail; //next slot to push
+	size_t head_cache; //last head seen by the producer
+	//read only after init
+	_Alignas(LFQ_CACHELINE) void** slots;
+	size_t mask;
+};
+
+struct lfq_mpsc_slot {
+	atomic_size_t seq; //position + 1 once the producer has filled data
+	void* data;
+};
+
+struct lfq_mpsc {
+	//consumer side
+	_Alignas(LFQ_CACHELINE) atomic_size_t head; //next slot to pop
+	//producer side, shared by all producers
+	_Alignas(LFQ_CACHELINE) atomic_size_t tail; //next slot to claim
+	//read only after init
+	_Alignas(LFQ_CACHELINE) struct lfq_mpsc_slot* slots;
+	size_t mask;
+};
+
+//-------------------------SPSC-------------------------
+/* LFQ_SPSC_INIT
+ * Description: allocates an empty queue of capacity slots
+ * Output: 0 if successful, -1 if capacity isn't a power of two or allocation failed
+ */
+static inline int lfq_spsc_init(struct lfq_spsc* q, size_t capacity) {
+	if(capacity == 0 || (capacity & (capacity - 1)))
+		return -1;
+	q->slots = calloc(capacity, sizeof(*q->slots));
+	if(!q->slots)
+		return -1;
+	q->mask = capacity - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	q->head_cache = 0;
+	q->tail_cache = 0;
+	return 0;
+}
+
+static inline void lfq_spsc_destroy(struct lfq_spsc* q) {
+	free(q->slots);
+	q->slots = NULL;
+}
+
+/* LFQ_SPSC_PUSH_BATCH
+ * Description: appends up to n items, in order
+ * Output: number of items queued, less than n if the queue filled up
+ * Safety: producer thread only
+ */
+static inline size_t lfq_spsc_push_batch(struct lfq_spsc* q, void* const* items, size_t n) {
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t capacity = q->mask + 1;
+
+	//only reload the consumer's index when the cached one says we're full
+	if(capacity - (tail - q->head_cache) < n)
+		q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+	size_t space = capacity - (tail - q->head_cache);
+	if(n > space)
+		n = space;
+
+	for(size_t i = 0; i < n; i++)
+		q->slots[(tail + i) & q->mask] = items[i];
+	atomic_store_explicit(&q->tail, tail + n, memory_order_release);
+	return n;
+}
+
+/* LFQ_SPSC_POP_BATCH
+ * Description: removes up to n items, oldest first
+ * Output: number of items stored in items, 0 if the queue is empty
+ * Safety: consumer thread only
+ */
+static inline size_t lfq_spsc_pop_batch(struct lfq_spsc* q, void** items, size_t n) {
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+	if(q->tail_cache - head < n)
+		q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+	size_t avail = q->tail_cache - head;
+	if(n > avail)
+		n = avail;
+
+	for(size_t i = 0; i < n; i++)
+		items[i] = q->slots[(head + i) & q->mask];
+	atomic_store_explicit(&q->head, head + n, memory_order_release);
+	return n;
+}
+
+/* LFQ_SPSC_PUSH
+ * Output: 0 if item was queued, -1 if the queue is full
+ */
+static inline int lfq_spsc_push(struct lfq_spsc* q, void* item) {
+	return lfq_spsc_push_batch(q, &item, 1) == 1 ? 0 : -1;
+}
+
+/* LFQ_SPSC_POP
+ * Output: oldest item, NULL if the queue is empty
+ */
+static inline void* lfq_spsc_pop(struct lfq_spsc* q) {
+	void* item;
+	return lfq_spsc_pop_batch(q, &item, 1) == 1 ? item : NULL;
+}
+
+//-------------------------MPSC-------------------------
+/* LFQ_MPSC_INIT
+ * Description: allocates an empty queue of capacity slots
+ * Output: 0 if successful, -1 if capacity isn't a power of two or allocation failed
+ */
+static inline int lfq_mpsc_init(struct lfq_mpsc* q, size_t capacity) {
+	if(capacity == 0 || (capacity & (capacity - 1)))
+		return -1;
+	q->slots = calloc(capacity, sizeof(*q->slots));
+	if(!q->slots)
+		return -1;
+	for(size_t i = 0; i < capacity; i++)
+		atomic_init(&q->slots[i].seq, 0);
+	q->mask = capacity - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return 0;
+}
+
+static inline void lfq_mpsc_destroy(struct lfq_mpsc* q) {
+	free(q->slots);
+	q->slots = NULL;
+}
+
+/* LFQ_MPSC_PUSH_BATCH
+ * Description: appends up to n items as one contiguous run, so items from
+ *  one call are never interleaved with another producer's
+ * Output: number of items queued, less than n if the queue filled up
+ * Safety: thread safe
+ */
+static inline size_t lfq_mpsc_push_batch(struct lfq_mpsc* q, void* const* items, size_t n) {
+	size_t capacity = q->mask + 1;
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t count;
+
+	//claim [tail, tail + count)
+	do {
+		size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+		size_t space = capacity - (tail - head);
+		count = n < space ? n : space;
+		if(count == 0)
+			return 0;
+	} while(!atomic_compare_exchange_weak_explicit(&q->tail, &tail, tail + count,
+			memory_order_relaxed, memory_order_relaxed));
+
+	//fill the claimed slots and publish each one to the consumer
+	for(size_t i = 0; i < count; i++) {
+		struct lfq_mpsc_slot* slot = &q->slots[(tail + i) & q->mask];
+		slot->data = items[i];
+		atomic_store_explicit(&slot->seq, tail + i + 1, memory_order_release);
+	}
+	return count;
+}
+
+/* LFQ_MPSC_POP_BATCH
+ * Description: removes up to n items, oldest first.  Stops early at a slot
+ *  that a producer has claimed but not filled yet.
+ * Output: number of items stored in items, 0 if nothing is ready
+ * Safety: consumer thread only
+ */
+static inline size_t lfq_mpsc_pop_batch(struct lfq_mpsc* q, void** items, size_t n) {
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t count = 0;
+
+	while(count < n) {
+		struct lfq_mpsc_slot* slot = &q->slots[(head + count) & q->mask];
+		if(atomic_load_explicit(&slot->seq, memory_order_acquire) != head + count + 1)
+			break;
+		items[count++] = slot->data;
+	}
+	//hands the slots back to the producers
+	if(count)
+		atomic_store_explicit(&q->head, head + count, memory_order_release);
+	return count;
+}
+
+/* LFQ_MPSC_PUSH
+ * Output: 0 if item was queued, -1 if the queue is full
+ */
+static inline int lfq_mpsc_push(struct lfq_mpsc* q, void* item) {
+	return lfq_mpsc_push_batch(q, &item, 1) == 1 ? 0 : -1;
+}
+
+/* LFQ_MPSC_POP
+ * Output: oldest ready item, NULL if none is ready
+ */
+static inline void* lfq_mpsc_pop(struct lfq_mpsc* q) {
+	void* item;
+	return lfq_mpsc_pop_batch(q, &item, 1) == 1 ? item : NULL;
+}
+
+#endif /* LFQUEUE_H_ */
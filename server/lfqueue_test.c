@@ -0,0 +1,154 @@
+/* Stress test of lfqueue.h
+ * Author: Madeleine Monfort
+ * Description:
+ *  Moves tagged items through the SPSC and MPSC queues with random batch
+ *  sizes on both sides and checks that every item arrives exactly once and
+ *  that each producer's items arrive in the order they were pushed.
+ *  Build with -fsanitize=thread to have the memory ordering checked as well.
+ *
+ * Usage: lfqueueTest [items per producer]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "lfqueue.h"
+
+#define DEFAULT_ITEMS 2000000
+#define PRODUCERS 4
+#define CAPACITY 1024
+#define MAX_BATCH 32
+
+//items are (producer << 40 | sequence) + 1, so none is NULL
+#define ITEM(p, s) ((void*)(uintptr_t)((((uint64_t)(p) << 40) | (s)) + 1))
+#define ITEM_PRODUCER(i) ((((uint64_t)(uintptr_t)(i)) - 1) >> 40)
+#define ITEM_SEQ(i) ((((uint64_t)(uintptr_t)(i)) - 1) & ((1ull << 40) - 1))
+
+static long items_per_producer = DEFAULT_ITEMS;
+static struct lfq_spsc spsc;
+static struct lfq_mpsc mpsc;
+
+static unsigned int batch_size(unsigned int* seed) {
+	return 1 + rand_r(seed) % MAX_BATCH;
+}
+
+static void* spsc_producer(void* arg) {
+	unsigned int seed = 1;
+	void* items[MAX_BATCH];
+	long next = 0;
+
+	while(next < items_per_producer) {
+		size_t n = batch_size(&seed);
+		if(n > (size_t)(items_per_producer - next))
+			n = items_per_producer - next;
+		for(size_t i = 0; i < n; i++)
+			items[i] = ITEM(0, next + i);
+		size_t pushed = lfq_spsc_push_batch(&spsc, items, n);
+		if(pushed == 0)
+			sched_yield();
+		next += pushed;
+	}
+	return NULL;
+}
+
+static void* mpsc_producer(void* arg) {
+	uint64_t id = (uintptr_t)arg;
+	unsigned int seed = id + 1;
+	void* items[MAX_BATCH];
+	long next = 0;
+
+	while(next < items_per_producer) {
+		size_t n = batch_size(&seed);
+		if(n > (size_t)(items_per_producer - next))
+			n = items_per_producer - next;
+		for(size_t i = 0; i < n; i++)
+			items[i] = ITEM(id, next + i);
+		size_t pushed = (n == 1) ? (lfq_mpsc_push(&mpsc, items[0]) == 0) : lfq_mpsc_push_batch(&mpsc, items, n);
+		if(pushed == 0)
+			sched_yield();
+		next += pushed;
+	}
+	return NULL;
+}
+
+/* CONSUME
+ * Description: pops until every producer's items arrived, checking order
+ * Output: 0 if successful, -1 upon a lost, duplicated or reordered item
+ */
+static int consume(int mpsc_mode, int producers) {
+	uint64_t expected[PRODUCERS] = { 0 };
+	long remaining = items_per_producer * producers;
+	unsigned int seed = 42;
+	void* items[MAX_BATCH];
+
+	while(remaining > 0) {
+		size_t n = batch_size(&seed);
+		size_t popped = mpsc_mode ? lfq_mpsc_pop_batch(&mpsc, items, n) : lfq_spsc_pop_batch(&spsc, items, n);
+		if(popped == 0) {
+			sched_yield();
+			continue;
+		}
+		for(size_t i = 0; i < popped; i++) {
+			uint64_t p = ITEM_PRODUCER(items[i]);
+			if(p >= (uint64_t)producers || ITEM_SEQ(items[i]) != expected[p]) {
+				printf("FAIL: producer %lu item %lu, expected %lu\n", (unsigned long)p,
+					(unsigned long)ITEM_SEQ(items[i]), (unsigned long)expected[p]);
+				return -1;
+			}
+			expected[p]++;
+		}
+		remaining -= popped;
+	}
+	//nothing may be left over
+	if((mpsc_mode ? lfq_mpsc_pop(&mpsc) : lfq_spsc_pop(&spsc)) != NULL) {
+		printf("FAIL: extra item in queue\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int run(int mpsc_mode, int producers) {
+	pthread_t threads[PRODUCERS];
+	int result;
+
+	for(int i = 0; i < producers; i++)
+		pthread_create(&threads[i], NULL, mpsc_mode ? mpsc_producer : spsc_producer, (void*)(uintptr_t)i);
+	result = consume(mpsc_mode, producers);
+	for(int i = 0; i < producers; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("%s %s: %ld items x %d producers\n", result ? "FAIL" : "PASS",
+		mpsc_mode ? "mpsc" : "spsc", items_per_producer, producers);
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	int result = 0;
+
+	if(argc > 1)
+		items_per_producer = atol(argv[1]);
+	if(items_per_producer <= 0) {
+		fprintf(stderr, "Usage: %s [items per producer]\n", argv[0]);
+		return 1;
+	}
+
+	//bad capacities are refused
+	if(lfq_spsc_init(&spsc, 0) == 0 || lfq_spsc_init(&spsc, 1000) == 0 || lfq_mpsc_init(&mpsc, 3) == 0) {
+		printf("FAIL: accepted a capacity that isn't a power of two\n");
+		return 1;
+	}
+	if(lfq_spsc_init(&spsc, CAPACITY) != 0 || lfq_mpsc_init(&mpsc, CAPACITY) != 0) {
+		perror("lfq init");
+		return 1;
+	}
+
+	result |= run(0, 1);
+	result |= run(1, 1);
+	result |= run(1, PRODUCERS);
+
+	lfq_spsc_destroy(&spsc);
+	lfq_mpsc_destroy(&mpsc);
+	return result ? 1 : 0;
+}